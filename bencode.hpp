@@ -6,6 +6,7 @@
 #include <map>
 #include <exception>
 #include <fstream>
+#include <iostream>
 
 using namespace std;
 
@@ -230,6 +231,43 @@ namespace bencode {
 			return dict[idx];
 		}
 		
+		bencode_type getType() const {
+			return type;
+		}
+		
+		long long getInteger() const {
+			if (type != bencode_type::integer) {
+				throw runtime_error("getInteger invalid for BencodeVal of this type");
+			}
+			
+			return integer;
+		}
+		
+		const string &getBytes() const {
+			if (type != bencode_type::bytes) {
+				throw runtime_error("getBytes invalid for BencodeVal of this type");
+			}
+			
+			return bytes;
+		}
+		
+		// unlike operator[], doesn't create the key if it's missing.
+		bool contains(const string &key) const {
+			if (type != bencode_type::dict) {
+				throw runtime_error("contains invalid for BencodeVal of this type");
+			}
+			
+			return dict.count(key);
+		}
+		
+		const BencodeVal &at(const string &key) const {
+			if (type != bencode_type::dict) {
+				throw runtime_error("at invalid for BencodeVal of this type");
+			}
+			
+			return dict.at(key);
+		}
+		
 		const string toString() const {
 			string r;
 			switch (type) {
@@ -0,0 +1,83 @@
+// torrent_tree's index: what each source file looked like (and which piece length
+// it got) when its .torrent was last written.  kept at <save directory>/.torrent_tree.index
+// across runs, in the journal's record format, and rewritten whole at the end of each run.
+#ifndef FILE_INDEX_HPP
+#define FILE_INDEX_HPP
+
+#include <string>
+#include <map>
+#include <mutex>
+#include <fstream>
+#include <cstdio>
+#include "bencode.hpp"
+#include "journal.hpp"
+
+using namespace std;
+
+namespace file_index {
+	struct Entry {
+		journal::FileId id;
+		uint64_t piece_length = 0;
+	};
+	
+	class FileIndex {
+		mutex lock;
+		map<string, Entry> prior; // as loaded
+		map<string, Entry> entries; // as of this run
+		
+		public:
+		
+		void load(const string &path) {
+			journal::readRecords(path, [this](const bencode::BencodeVal &rec) {
+				Entry &e = prior[rec.at("path").getBytes()];
+				e.id = journal::dictToId(rec);
+				e.piece_length = rec.at("piece length").getInteger();
+			});
+		}
+		
+		// what path looked like last run, if we know.
+		bool find(const string &path, Entry &e) {
+			lock_guard<mutex> l(lock);
+			auto it = prior.find(path);
+			if (it == prior.end()) return false;
+			e = it->second;
+			return true;
+		}
+		
+		// path's .torrent was (re)written, or is known current.
+		void set(const string &path, const Entry &e) {
+			lock_guard<mutex> l(lock);
+			entries[path] = e;
+		}
+		
+		// path was seen but left alone; whatever we knew about it still holds.
+		void keep(const string &path) {
+			lock_guard<mutex> l(lock);
+			auto it = prior.find(path);
+			if (it != prior.end()) {
+				entries[path] = it->second;
+			}
+		}
+		
+		// only files seen this run make it in, so deleted files fall out.
+		bool save(const string &path) {
+			lock_guard<mutex> l(lock);
+			string tmp_path = path + ".tmp";
+			ofstream ofile(tmp_path, ios::out|ios::trunc|ios::binary);
+			for (auto &x : entries) {
+				bencode::BencodeVal rec = journal::idToDict(x.second.id);
+				rec["path"] = x.first;
+				rec["piece length"] = (long long)x.second.piece_length;
+				ofile << journal::wrapRecord(rec);
+			}
+			ofile.close();
+			if (!ofile || rename(tmp_path.c_str(), path.c_str())) {
+				perror("failed to write index");
+				return false;
+			}
+			return true;
+		}
+	};
+}
+
+#endif
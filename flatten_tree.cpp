@@ -1,15 +1,18 @@
 #include <iostream>
 #include <filesystem>
-#include <fstream>
 #include <getopt.h>
 #include <set>
-#include "sha1.hpp"
-#include "bencode.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include "torrent_sync.hpp"
 
 using namespace std;
 
 void usage() {
-	cout << "Usage: flatten_tree -[vquf] [--ignore file_or_dir ...] <source directory> <save directory>\n"
+	cout << "Usage: flatten_tree -[vquf] [--ignore file_or_dir ...] [--fanout n] <source directory> <save directory>\n"
+		"       flatten_tree [-v] --migrate n <save directory>\n"
+		"       flatten_tree --lookup hash <save directory>\n"
 		"\tCreates a flat (no subdirectories) version of all the files within\n"
 		"\t\033[1msource directory\033[0m at \033[1msave directory\033[0m,\n"
 		"\tcreating it if necessary.  Files are named after their info_hash\n\n"
@@ -20,36 +23,18 @@ void usage() {
 		"\t\tthe source file is newer than the existing .torrent\n\n"
 		"\t-f\n\t\tForce overwrite - All existing .torrent files will be overwritten\n\n"
 		"\t--ignore dir\n"
-		"\t\tIf dir is found, do not recurse into it.\n";
-}
-
-// this function from fredoverflow on stackoverflow.  short and simple, I definitely am not gonna make a better one.
-string string_to_hex(const string& input)
-{
-	static const char hex_digits[] = "0123456789abcdef";
-	
-	string output;
-	output.reserve(input.length() * 2);
-	for (unsigned char c : input) {
-		output.push_back(hex_digits[c >> 4]);
-		output.push_back(hex_digits[c & 15]);
-	}
-	return output;
-}
-
-string info_hash(filesystem::path p) {
-	ifstream f;
-	f.exceptions(ifstream::failbit|ifstream::badbit);
-	f.open(p, ios::in|ios::binary|ios::ate);
-	
-	auto size = f.tellg();
-	f.seekg(0);
-	string buff(size, '\0');
-	f.read(&buff[0], size);
-	f.close();
-	bencode::BencodeVal b = bencode::BencodeVal::parse(buff);
-	return sha1::hash(b["info"].toString());
-	
+		"\t\tIf dir is found, do not recurse into it.\n\n"
+		"\t--fanout n\n"
+		"\t\tSpread files over n levels of subdirectories named for the leading\n"
+		"\t\tbytes of their info_hash (n = 2: ab/cd/abcd....torrent), up to 4.\n"
+		"\t\tThe layout is recorded in save directory, so only needed the first\n"
+		"\t\ttime.  Default is flat\n\n"
+		"\t--migrate n\n"
+		"\t\tRearrange an existing save directory to n levels of fan-out (0 for\n"
+		"\t\tflat), in place, with renames only.  Safe to re-run if interrupted\n\n"
+		"\t--lookup hash\n"
+		"\t\tPrint where the torrent with info_hash hash lives in save directory,\n"
+		"\t\texiting 0 if it's there, 1 if not, and 2 if hash isn't 40 hex digits\n";
 }
 
 #define OVERWRITE_NONE 0
@@ -62,6 +47,11 @@ short overwrite = OVERWRITE_NONE;
 set<filesystem::path> ignored_dirs;
 string start_path;
 filesystem::path out_path;
+unsigned int fanout = 0;
+
+bool is_hex(const string &s) {
+	return all_of(s.begin(), s.end(), [](char c) { return isdigit(c) || (c >= 'a' && c <= 'f'); });
+}
 
 void process_file(filesystem::directory_entry entry) {
 	filesystem::path path = entry.path();
@@ -70,12 +60,15 @@ void process_file(filesystem::directory_entry entry) {
 	}
 	string hash;
 	try {
-		hash = info_hash(path);
+		hash = torrent_sync::info_hash(path);
 	} catch (...) {
 		cerr << "Failed to calculate info_hash for " << path << endl;
 		return;
 	}
-	filesystem::path file_path = out_path / (string_to_hex(hash) + ".torrent");
+	filesystem::path file_path = torrent_sync::torrent_path(out_path, torrent_sync::string_to_hex(hash), fanout);
+	if (fanout) {
+		filesystem::create_directories(file_path.parent_path());
+	}
 	filesystem::copy_options o = overwrite == OVERWRITE_NONE ? filesystem::copy_options::skip_existing :
 		(overwrite == OVERWRITE_NEWER ? filesystem::copy_options::update_existing :
 		filesystem::copy_options::overwrite_existing);
@@ -85,11 +78,66 @@ void process_file(filesystem::directory_entry entry) {
 	}
 }
 
+// moves every <info_hash>.torrent in out_path to where levels of fan-out says it
+// belongs, then clears out fan-out directories left empty.  renames only, and
+// picks up where it left off if re-run after being interrupted.
+int migrate(unsigned int levels) {
+	vector<filesystem::path> torrents, dirs;
+	for (auto it = filesystem::recursive_directory_iterator(out_path); it != filesystem::recursive_directory_iterator(); ++it) {
+		string name = it->path().filename().string();
+		if (it->is_directory()) {
+			// only ever descend into our own fan-out directories.
+			if (name.size() == 2 && is_hex(name)) {
+				dirs.push_back(it->path());
+			} else {
+				it.disable_recursion_pending();
+			}
+		} else if (it->is_regular_file() && it->path().extension() == ".torrent") {
+			string stem = it->path().stem().string();
+			if (torrent_sync::is_info_hash(stem)) {
+				torrents.push_back(it->path());
+			}
+		}
+	}
+	
+	size_t moved = 0;
+	for (const filesystem::path &p : torrents) {
+		filesystem::path dest = torrent_sync::torrent_path(out_path, p.stem().string(), levels);
+		if (dest == p) continue;
+		filesystem::create_directories(dest.parent_path());
+		filesystem::rename(p, dest);
+		moved++;
+		if (verbose) {
+			cout << "Moved " << p << " to " << dest << endl;
+		}
+	}
+	
+	// deepest first, so parents are empty by the time we get to them.
+	sort(dirs.begin(), dirs.end(), [](const filesystem::path &a, const filesystem::path &b) {
+		return distance(a.begin(), a.end()) > distance(b.begin(), b.end());
+	});
+	for (const filesystem::path &d : dirs) {
+		error_code ec;
+		if (filesystem::is_empty(d, ec) && !ec) {
+			filesystem::remove(d, ec);
+		}
+	}
+	
+	torrent_sync::set_fanout(out_path, levels);
+	cout << "Moved " << moved << " of " << torrents.size() << " torrents to " << levels << " level(s) of fan-out" << endl;
+	return 0;
+}
+
 int main(int argc, char *argv[]) {
 	struct option long_options[] = {
 		{"ignore", required_argument, 0, 0},
+		{"fanout", required_argument, 0, 'F'},
+		{"migrate", required_argument, 0, 'M'},
+		{"lookup", required_argument, 0, 'L'},
 		{0, 0, 0, 0}
 	};
+	int fanout_arg = -1, migrate_to = -1;
+	string lookup;
 	int c, option_index;
 	while ((c = getopt_long(argc, argv, "vquf", long_options, &option_index)) != -1) {
 		
@@ -106,6 +154,23 @@ int main(int argc, char *argv[]) {
 			case 'f':
 				overwrite = OVERWRITE_ALL;
 				break;
+			case 'F':
+			case 'M':
+				{
+					char *end;
+					errno = 0;
+					long levels = strtol(optarg, &end, 10);
+					if (errno || end == optarg || *end || levels < 0 || levels > (long)torrent_sync::max_fanout) {
+						cerr << "Fan-out must be 0 to " << torrent_sync::max_fanout << " levels" << endl;
+						usage();
+						return 1;
+					}
+					(c == 'F' ? fanout_arg : migrate_to) = levels;
+				}
+				break;
+			case 'L':
+				lookup = optarg;
+				break;
 			case 0:
 				{
 					filesystem::path t = filesystem::absolute(optarg);
@@ -127,6 +192,29 @@ int main(int argc, char *argv[]) {
 		}
 	}
 	
+	if (migrate_to >= 0 || !lookup.empty()) {
+		if (argc != optind + 1) {
+			usage();
+			return 1;
+		}
+		out_path = argv[optind];
+		if (!filesystem::is_directory(filesystem::status(out_path))) {
+			cerr << "No such directory: " << out_path << endl;
+			return 2;
+		}
+		if (migrate_to >= 0) {
+			return migrate(migrate_to);
+		}
+		transform(lookup.begin(), lookup.end(), lookup.begin(), ::tolower);
+		if (!torrent_sync::is_info_hash(lookup)) {
+			cerr << "Not an info_hash (40 hex digits): " << lookup << endl;
+			return 2;
+		}
+		filesystem::path p = torrent_sync::torrent_path(out_path, lookup, torrent_sync::get_fanout(out_path));
+		cout << p.string() << endl;
+		return filesystem::exists(p) ? 0 : 1;
+	}
+	
 	if (argc != optind + 2) {
 		usage();
 		return 1;
@@ -157,28 +245,34 @@ int main(int argc, char *argv[]) {
 		}
 	}
 	
+	fanout = torrent_sync::get_fanout(out_path);
+	if (fanout_arg >= 0 && (unsigned int)fanout_arg != fanout) {
+		if (!filesystem::is_empty(out_path)) {
+			cerr << out_path << " is laid out with " << fanout << " level(s) of fan-out, not " << fanout_arg
+				<< ".  Use --migrate to change it" << endl;
+			return 4;
+		}
+		fanout = fanout_arg;
+		torrent_sync::set_fanout(out_path, fanout);
+	}
+	
 	// because we did no error checking above, getting here should mean all is well
 	// (or exceptions would've occurred).  That's right, I just bragged about not checking for errors.
 	if (start_path.back() == '/') start_path.pop_back();
-	vector<filesystem::path> path_stack {start_path};
-	
-	for (size_t i = 0; i < path_stack.size(); i++) {
-		for (auto &entry : filesystem::directory_iterator(path_stack[i])) {
-			if (entry.is_regular_file()) {
-				
-				process_file(entry);
-				
-			} else if (entry.is_directory()) {
-				filesystem::path t = filesystem::absolute(entry.path());
-				if (ignored_dirs.count(t)) {
-					if (verbose) {
-						cout << "Skipping ignored directory " << t << endl;
-					}
-					continue;
-				}
-				path_stack.push_back(entry.path());
+	torrent_sync::walk_tree(start_path, ignored_dirs,
+		[](const filesystem::directory_entry &entry) {
+			// torrent_tree keeps its journal (and in-flight .tmp files) in
+			// the same tree.  those aren't ours.
+			if (entry.path().extension() != ".torrent") {
+				return;
 			}
-		}
-	}
+			
+			process_file(entry);
+		},
+		[](const filesystem::path &t) {
+			if (verbose) {
+				cout << "Skipping ignored directory " << t << endl;
+			}
+		});
 	return 0;
 }
\ No newline at end of file
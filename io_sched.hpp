@@ -0,0 +1,106 @@
+// groups files by the disk they live on, so every disk gets its own (small)
+// set of readers.  one HDD being asked for two files at once spends its time
+// seeking; two HDDs each asked for one file both stream.
+#ifndef IO_SCHED_HPP
+#define IO_SCHED_HPP
+
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <cstdio>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+using namespace std;
+
+namespace io_sched {
+	// st_dev is the filesystem's device, which for a partition (or LVM on a single
+	// disk) isn't the thing doing the seeking.  follow /sys/dev/block back to the
+	// whole disk when we can, and settle for st_dev when we can't (nfs, tmpfs, etc).
+	inline dev_t disk_of(dev_t dev) {
+		for (int depth = 0; depth < 8; depth++) {
+			char link[64];
+			snprintf(link, sizeof(link), "/sys/dev/block/%u:%u", major(dev), minor(dev));
+			error_code ec;
+			filesystem::path p = filesystem::canonical(link, ec);
+			if (ec) break;
+			
+			filesystem::path parent;
+			if (filesystem::exists(p / "partition", ec)) {
+				parent = p.parent_path();
+			} else {
+				// device mapper/md sitting on exactly one device: that one.
+				vector<filesystem::path> slaves;
+				for (auto &s : filesystem::directory_iterator(p / "slaves", ec)) {
+					slaves.push_back(filesystem::canonical(s.path(), ec));
+				}
+				if (slaves.size() != 1) break;
+				parent = slaves[0];
+			}
+			
+			ifstream f(parent / "dev");
+			unsigned int ma, mi;
+			char colon;
+			if (!(f >> ma >> colon >> mi) || colon != ':') break;
+			dev = makedev(ma, mi);
+		}
+		return dev;
+	}
+	
+	class DeviceScheduler {
+		map<dev_t, dev_t> disks; // st_dev -> disk_of(st_dev), to only hit /sys once per filesystem.
+		map<dev_t, vector<filesystem::directory_entry>> queues;
+		
+		public:
+		
+		// returns false if the file couldn't be stat'd.
+		bool add(const filesystem::directory_entry &entry) {
+			struct stat st;
+			if (stat(entry.path().c_str(), &st)) {
+				return false;
+			}
+			auto it = disks.find(st.st_dev);
+			if (it == disks.end()) {
+				it = disks.emplace(st.st_dev, disk_of(st.st_dev)).first;
+			}
+			queues[it->second].push_back(entry);
+			return true;
+		}
+		
+		size_t deviceCount() const {
+			return queues.size();
+		}
+		
+		// runs work over every queued file, per_device at a time on each disk,
+		// all disks at once.  files on a disk are handed out in the order added.
+		void run(unsigned int per_device, function<void(const filesystem::directory_entry &)> work) {
+			if (!per_device) per_device = 1;
+			vector<thread> threads;
+			vector<atomic<size_t>> next(queues.size());
+			size_t q = 0;
+			for (auto &x : queues) {
+				vector<filesystem::directory_entry> &files = x.second;
+				atomic<size_t> &idx = next[q++];
+				idx = 0;
+				for (unsigned int i = 0; i < per_device && i < files.size(); i++) {
+					threads.emplace_back([&files, &idx, &work]() {
+						size_t n;
+						while ((n = idx++) < files.size()) {
+							work(files[n]);
+						}
+					});
+				}
+			}
+			for (thread &t : threads) {
+				t.join();
+			}
+			queues.clear();
+		}
+	};
+}
+
+#endif
@@ -0,0 +1,313 @@
+// checkpoint journal, letting an interrupted torrent_tree run pick back up where it died.
+// every record is a bencoded dict, wrapped as a bencoded byte string ("123:d...e") so
+// a record cut short by a crash is easy to spot and throw away on load.  torrent_tree's
+// index uses the same record format.
+#ifndef JOURNAL_HPP
+#define JOURNAL_HPP
+
+#include <string>
+#include <map>
+#include <mutex>
+#include <functional>
+#include <fstream>
+#include <vector>
+#include <chrono>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <cerrno>
+#include "bencode.hpp"
+
+using namespace std;
+
+namespace journal {
+	inline string wrapRecord(const bencode::BencodeVal &rec) {
+		return bencode::BencodeVal(rec.toString()).toString();
+	}
+	
+	// calls f with every whole record in path.  a truncated trailing record
+	// (we died mid-write) is silently dropped, as are mangled ones.  returns the
+	// offset just past the last whole record, where anything more should go.
+	inline size_t readRecords(const string &path, const function<void(const bencode::BencodeVal &)> &f) {
+		ifstream ifile(path, ios::in|ios::binary|ios::ate);
+		if (!ifile) return 0;
+		size_t size = ifile.tellg();
+		string buff(size, '\0');
+		ifile.seekg(0);
+		if (!ifile.read(&buff[0], size)) return 0;
+		
+		size_t pos = 0;
+		while (pos < buff.size()) {
+			size_t colon = buff.find(':', pos);
+			if (colon == string::npos) break;
+			size_t len;
+			try {
+				len = stoul(buff.substr(pos, colon - pos));
+			} catch (...) {
+				break;
+			}
+			if (colon + 1 + len > buff.size()) break;
+			try {
+				f(bencode::BencodeVal::parse(buff.substr(colon + 1, len)));
+			} catch (exception &e) {
+				// a mangled record.  skip it, the rest may still be fine.
+			}
+			pos = colon + 1 + len;
+		}
+		return pos;
+	}
+	
+	// what we consider to be "the same file" from one run to the next.
+	struct FileId {
+		uint64_t device = 0;
+		uint64_t inode = 0;
+		uint64_t size = 0;
+		int64_t mtime = 0; // nanoseconds
+		
+		bool operator==(const FileId &o) const {
+			return device == o.device && inode == o.inode && size == o.size && mtime == o.mtime;
+		}
+		bool operator!=(const FileId &o) const {
+			return !(*this == o);
+		}
+	};
+	
+	inline bool identify(const string &path, FileId &id) {
+		struct stat st;
+		if (stat(path.c_str(), &st)) {
+			return false;
+		}
+		id.device = st.st_dev;
+		id.inode = st.st_ino;
+		id.size = st.st_size;
+		id.mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+		return true;
+	}
+	
+	inline bencode::BencodeVal idToDict(const FileId &id) {
+		bencode::BencodeVal r(bencode::bencode_type::dict);
+		r["device"] = (long long)id.device;
+		r["inode"] = (long long)id.inode;
+		r["size"] = (long long)id.size;
+		r["mtime"] = (long long)id.mtime;
+		return r;
+	}
+	
+	inline FileId dictToId(const bencode::BencodeVal &d) {
+		FileId id;
+		id.device = d.at("device").getInteger();
+		id.inode = d.at("inode").getInteger();
+		id.size = d.at("size").getInteger();
+		id.mtime = d.at("mtime").getInteger();
+		return id;
+	}
+	
+	// a large file that was partway through hashing.  pieces holds every
+	// piece hash covering [0, offset).
+	struct Partial {
+		FileId id;
+		uint64_t piece_length = 0;
+		uint64_t offset = 0;
+		string pieces;
+	};
+	
+	// finish records are held back and written this many at a time (or once the
+	// oldest has waited finish_delay), each batch after a single syncfs.
+	const size_t finish_batch = 1024;
+	const auto finish_delay = chrono::seconds(10);
+	
+	class Journal {
+		int fd = -1;
+		int data_fd = -1;
+		mutex lock;
+		map<string, FileId> done;
+		map<string, Partial> partial;
+		vector<string> finished_batch;
+		string loaded_path;
+		size_t loaded_end = 0;
+		chrono::steady_clock::time_point batch_started;
+		
+		// caller holds lock.
+		void append(const bencode::BencodeVal &rec, bool sync) {
+			write(wrapRecord(rec), sync);
+		}
+		
+		// caller holds lock.
+		void write(const string &data, bool sync) {
+			if (fd < 0) return;
+			const char *p = data.data();
+			size_t left = data.size();
+			while (left) {
+				ssize_t w = ::write(fd, p, left);
+				if (w < 0) {
+					if (errno == EINTR) continue;
+					perror("failed to write journal");
+					return;
+				}
+				p += w;
+				left -= w;
+			}
+			if (sync) {
+				fdatasync(fd);
+			}
+		}
+		
+		// a finish record must never reach the disk ahead of the .torrent it vouches
+		// for, or a power cut could leave it pointing at an empty file.  syncing
+		// everything written so far first is one flush per batch, not two per file.
+		// caller holds lock.
+		void flushFinished() {
+			if (finished_batch.empty()) return;
+			if (data_fd >= 0) {
+				syncfs(data_fd);
+			}
+			string data;
+			for (const string &r : finished_batch) {
+				data += r;
+			}
+			finished_batch.clear();
+			write(data, true);
+		}
+		
+		void replay(const bencode::BencodeVal &rec) {
+			const string &t = rec.at("type").getBytes();
+			const string &path = rec.at("path").getBytes();
+			if (t == "file") {
+				done[path] = dictToId(rec);
+				partial.erase(path);
+			} else if (t == "begin") {
+				Partial &p = partial[path];
+				p.id = dictToId(rec);
+				p.piece_length = rec.at("piece length").getInteger();
+				p.offset = 0;
+				p.pieces.clear();
+				done.erase(path);
+			} else if (t == "pieces") {
+				auto it = partial.find(path);
+				if (it == partial.end()) return;
+				Partial &p = it->second;
+				const string &pieces = rec.at("pieces").getBytes();
+				uint64_t offset = rec.at("offset").getInteger();
+				// each checkpoint only carries the hashes since the one before it,
+				// so they'd better line up.
+				if (pieces.size() % 20 || offset - (pieces.size() / 20) * p.piece_length != p.offset) {
+					partial.erase(it);
+					return;
+				}
+				p.pieces += pieces;
+				p.offset = offset;
+			}
+		}
+		
+		public:
+		
+		~Journal() {
+			close();
+		}
+		
+		// read in any records from a previous run.
+		void load(const string &path) {
+			loaded_end = readRecords(path, [this](const bencode::BencodeVal &rec) { replay(rec); });
+			loaded_path = path;
+		}
+		
+		// keep = false starts the journal over.  keep = true carries on after the
+		// last whole record, cutting off whatever a crash left half-written there;
+		// appending after it would make everything we write unreadable.
+		bool open(const string &path, bool keep) {
+			fd = ::open(path.c_str(), O_WRONLY|O_CREAT|O_APPEND|(keep ? 0 : O_TRUNC), 0644);
+			if (fd < 0) {
+				perror("failed to open journal");
+				return false;
+			}
+			if (keep) {
+				size_t end = path == loaded_path ? loaded_end : readRecords(path, [](const bencode::BencodeVal &) {});
+				if (ftruncate(fd, end)) {
+					perror("failed to trim journal");
+					::close(fd);
+					fd = -1;
+					return false;
+				}
+			}
+			return true;
+		}
+		
+		// the .torrent files finish records vouch for are under dir.
+		void setDataDir(const string &dir) {
+			data_fd = ::open(dir.c_str(), O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+			if (data_fd < 0) {
+				perror("failed to open save directory");
+			}
+		}
+		
+		void close() {
+			lock_guard<mutex> l(lock);
+			flushFinished();
+			if (data_fd >= 0) {
+				::close(data_fd);
+				data_fd = -1;
+			}
+			if (fd >= 0) {
+				fdatasync(fd);
+				::close(fd);
+				fd = -1;
+			}
+		}
+		
+		bool finished(const string &path, const FileId &id) {
+			lock_guard<mutex> l(lock);
+			auto it = done.find(path);
+			return it != done.end() && it->second == id;
+		}
+		
+		// fills p and returns true if path was checkpointed partway through
+		// and hasn't changed since.
+		bool resumePoint(const string &path, const FileId &id, uint64_t piece_length, Partial &p) {
+			lock_guard<mutex> l(lock);
+			auto it = partial.find(path);
+			if (it == partial.end() || it->second.id != id || it->second.piece_length != piece_length) {
+				return false;
+			}
+			p = it->second;
+			return true;
+		}
+		
+		void begin(const string &path, const FileId &id, uint64_t piece_length) {
+			bencode::BencodeVal rec = idToDict(id);
+			rec["type"] = string("begin");
+			rec["path"] = path;
+			rec["piece length"] = (long long)piece_length;
+			lock_guard<mutex> l(lock);
+			append(rec, true);
+		}
+		
+		// pieces holds only the hashes added since the last checkpoint (or begin).
+		void checkpoint(const string &path, uint64_t offset, const string &pieces) {
+			bencode::BencodeVal rec(bencode::bencode_type::dict);
+			rec["type"] = string("pieces");
+			rec["path"] = path;
+			rec["offset"] = (long long)offset;
+			rec["pieces"] = pieces;
+			lock_guard<mutex> l(lock);
+			append(rec, true);
+		}
+		
+		void finish(const string &path, const FileId &id) {
+			bencode::BencodeVal rec = idToDict(id);
+			rec["type"] = string("file");
+			rec["path"] = path;
+			lock_guard<mutex> l(lock);
+			// batched.  losing a few of these to a power cut only costs re-hashing
+			// those files, and syncing per file kills small-file runs.
+			if (finished_batch.empty()) {
+				batch_started = chrono::steady_clock::now();
+			}
+			finished_batch.push_back(wrapRecord(rec));
+			if (finished_batch.size() >= finish_batch || chrono::steady_clock::now() - batch_started >= finish_delay) {
+				flushFinished();
+			}
+		}
+	};
+}
+
+#endif
@@ -0,0 +1,192 @@
+// what piece-length policies cost: .torrent size and per-piece client state for a
+// set of file sizes, and how fast hash_pieces goes at each piece length.
+#include <iostream>
+#include <iomanip>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <getopt.h>
+#include "bencode.hpp"
+#include "journal.hpp"
+#include "torrent_sync.hpp"
+
+using namespace std;
+
+void usage() {
+	cout << "Usage: piece_bench [--index file] [--policy policy ...] [--size MiB] [--dir directory]\n"
+		"\tCompares piece-length policies (as taken by torrent_tree --piece-length)\n"
+		"\tover a set of file sizes, then times hashing at each piece length.\n\n"
+		"Options:\n"
+		"\t--index file\n"
+		"\t\tTake file sizes from a torrent_tree .torrent_tree.index.  Without it,\n"
+		"\t\tfour sizes per doubling from 1K to 1T are used\n\n"
+		"\t--policy policy\n"
+		"\t\tA policy to compare.  Repeatable.  Defaults to default,\n"
+		"\t\tdefault,max=16M, max-pieces=2000 and 4M\n\n"
+		"\t--size MiB\n"
+		"\t\tSize of the scratch file hashed for throughput (default 256).  0 skips\n"
+		"\t\tthe throughput test\n\n"
+		"\t--dir directory\n"
+		"\t\tWhere to put the scratch file (default the system temp directory)\n";
+}
+
+// rough size of everything in a single-file .torrent but the pieces.
+const uint64_t torrent_overhead = 200;
+
+string human(double bytes) {
+	const char *units[] = {"B", "K", "M", "G", "T"};
+	int u = 0;
+	while (bytes >= 1024 && u < 4) {
+		bytes /= 1024;
+		u++;
+	}
+	ostringstream o;
+	o << fixed << setprecision(u ? 1 : 0) << bytes << units[u];
+	return o.str();
+}
+
+void compare(const vector<uint64_t> &sizes, const vector<torrent_sync::PieceLengthPolicy> &policies) {
+	uint64_t total = 0;
+	for (uint64_t s : sizes) {
+		total += s;
+	}
+	cout << sizes.size() << " files, " << human(total) << "\n\n";
+	
+	// a client keeps a 20-byte hash and a have bit for every piece of every
+	// torrent it's seeding; "client" below is that, summed over all of them.
+	// "biggest piece" is what it has to hold in memory to check one piece.
+	cout << left << setw(28) << "policy" << right
+		<< setw(14) << "pieces" << setw(12) << ".torrents" << setw(14) << "max .torrent"
+		<< setw(12) << "client" << setw(15) << "biggest piece" << "\n";
+	for (auto &p : policies) {
+		uint64_t pieces = 0, torrents = 0, max_torrent = 0, max_piece = 0;
+		for (uint64_t s : sizes) {
+			uint64_t pl = p.pieceLength(s);
+			uint64_t n = s / pl + (s % pl ? 1 : 0);
+			uint64_t t = n * 20 + torrent_overhead;
+			pieces += n;
+			torrents += t;
+			max_torrent = max(max_torrent, t);
+			max_piece = max(max_piece, pl);
+		}
+		cout << left << setw(28) << p.describe() << right
+			<< setw(14) << pieces << setw(12) << human(torrents) << setw(14) << human(max_torrent)
+			<< setw(12) << human(pieces * 20 + pieces / 8) << setw(15) << human(max_piece) << "\n";
+	}
+	cout << endl;
+}
+
+// hashes a scratch file of size bytes at each piece length from 16K to 16M, the
+// best of a few runs each.  hash_pieces drops what it's read from the page cache
+// as it goes, so this is reading from disk much as a real run would.
+void throughput(const filesystem::path &dir, uint64_t size) {
+	filesystem::path scratch = dir / ("piece_bench." + to_string(getpid()));
+	{
+		ofstream f(scratch, ios::out|ios::trunc|ios::binary);
+		mt19937_64 rng(1);
+		vector<uint64_t> block(1 << 17);
+		for (uint64_t written = 0; written < size; written += block.size() * 8) {
+			for (auto &w : block) {
+				w = rng();
+			}
+			f.write((const char *)block.data(), min((uint64_t)block.size() * 8, size - written));
+		}
+		f.close();
+		if (!f) {
+			filesystem::remove(scratch);
+			throw runtime_error("failed to write " + scratch.string());
+		}
+	}
+	
+	cout << "hashing " << human(size) << " from " << scratch << "\n\n";
+	cout << setw(14) << "piece length" << setw(10) << "pieces" << setw(12) << "MiB/s" << "\n";
+	for (uint64_t pl = (uint64_t)16 << 10; pl <= (uint64_t)16 << 20; pl <<= 2) {
+		double best = 0;
+		for (int run = 0; run < 3; run++) {
+			string pieces;
+			auto start = chrono::steady_clock::now();
+			torrent_sync::hash_pieces(scratch, size, pl, pieces);
+			chrono::duration<double> took = chrono::steady_clock::now() - start;
+			best = max(best, size / took.count() / (1 << 20));
+		}
+		cout << setw(14) << human(pl) << setw(10) << (size / pl + (size % pl ? 1 : 0))
+			<< setw(12) << fixed << setprecision(1) << best << "\n";
+	}
+	filesystem::remove(scratch);
+}
+
+int main(int argc, char *argv[]) {
+	struct option long_options[] = {
+		{"index", required_argument, 0, 'i'},
+		{"policy", required_argument, 0, 'p'},
+		{"size", required_argument, 0, 's'},
+		{"dir", required_argument, 0, 'd'},
+		{0, 0, 0, 0}
+	};
+	string index_path;
+	vector<torrent_sync::PieceLengthPolicy> policies;
+	uint64_t size = (uint64_t)256 << 20;
+	filesystem::path dir = filesystem::temp_directory_path();
+	int c, option_index;
+	while ((c = getopt_long(argc, argv, "", long_options, &option_index)) != -1) {
+		switch (c) {
+			case 'i':
+				index_path = optarg;
+				break;
+			case 'p':
+				policies.emplace_back();
+				if (!policies.back().parse(optarg)) {
+					cerr << "Can't make sense of --policy " << optarg << endl;
+					usage();
+					return 1;
+				}
+				break;
+			case 's':
+				size = strtoull(optarg, nullptr, 10) << 20;
+				break;
+			case 'd':
+				dir = optarg;
+				break;
+			default:
+				usage();
+				return 1;
+		}
+	}
+	if (optind != argc) {
+		usage();
+		return 1;
+	}
+	if (policies.empty()) {
+		for (const char *spec : {"default", "default,max=16M", "max-pieces=2000", "4M"}) {
+			policies.emplace_back();
+			policies.back().parse(spec);
+		}
+	}
+	
+	vector<uint64_t> sizes;
+	if (index_path.size()) {
+		journal::readRecords(index_path, [&](const bencode::BencodeVal &rec) {
+			sizes.push_back(rec.at("size").getInteger());
+		});
+		if (sizes.empty()) {
+			cerr << "No files in " << index_path << endl;
+			return 2;
+		}
+	} else {
+		for (unsigned int k = 10; k < 40; k++) {
+			for (uint64_t q = 4; q < 8; q++) {
+				sizes.push_back(((uint64_t)1 << k) / 4 * q);
+			}
+		}
+		sizes.push_back((uint64_t)1 << 40);
+	}
+	
+	compare(sizes, policies);
+	if (size) {
+		throughput(dir, size);
+	}
+	return 0;
+}
@@ -0,0 +1,296 @@
+// splitting one torrent_tree run across several machines that all see the same
+// source directory.  every node works out the same assignment of files to shards
+// on its own; --merge then checks the pieces fit back together with nothing
+// missing or doubled up.
+#ifndef SHARD_HPP
+#define SHARD_HPP
+
+#include <string>
+#include <map>
+#include <set>
+#include <vector>
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include "bencode.hpp"
+#include "journal.hpp"
+#include "file_index.hpp"
+
+using namespace std;
+
+namespace shard {
+	// FNV-1a.  stable across machines, compilers and runs, unlike std::hash.
+	inline uint64_t stable_hash(const string &s) {
+		uint64_t h = 0xcbf29ce484222325ULL;
+		for (unsigned char c : s) {
+			h ^= c;
+			h *= 0x100000001b3ULL;
+		}
+		return h;
+	}
+	
+	// ".2-of-4", tacked onto the journal/index/manifest names so shards can
+	// share a save directory.
+	inline string suffix(unsigned int index, unsigned int count) {
+		return "." + to_string(index) + "-of-" + to_string(count);
+	}
+	
+	class Plan {
+		unsigned int index = 0, count = 1;
+		map<string, unsigned int> balanced;
+		
+		// digits only (no sign, no spaces), and fits in n.
+		static bool parseNumber(const string &s, unsigned int &n) {
+			if (s.empty() || s.size() > 9 || !all_of(s.begin(), s.end(), [](char c) { return c >= '0' && c <= '9'; })) return false;
+			n = stoul(s);
+			return true;
+		}
+		
+		public:
+		
+		bool active() const {
+			return count > 1;
+		}
+		
+		unsigned int getIndex() const {
+			return index;
+		}
+		
+		unsigned int getCount() const {
+			return count;
+		}
+		
+		// "i/N", nothing more.  on failure the plan is left as it was.
+		bool parse(const string &spec) {
+			size_t slash = spec.find('/');
+			if (slash == string::npos) return false;
+			unsigned int i, n;
+			if (!parseNumber(spec.substr(0, slash), i) || !parseNumber(spec.substr(slash + 1), n)
+				|| !n || i >= n) {
+				return false;
+			}
+			index = i;
+			count = n;
+			return true;
+		}
+		
+		// spread the files in a prior index across shards by size, biggest first,
+		// each to whichever shard has the least so far.  the result depends only
+		// on the index file, so every node gets the same answer from the same copy.
+		void balance(const string &index_path) {
+			vector<pair<uint64_t, string>> files;
+			journal::readRecords(index_path, [&](const bencode::BencodeVal &rec) {
+				files.emplace_back(rec.at("size").getInteger(), rec.at("path").getBytes());
+			});
+			sort(files.begin(), files.end(), [](const pair<uint64_t, string> &a, const pair<uint64_t, string> &b) {
+				return a.first != b.first ? a.first > b.first : a.second < b.second;
+			});
+			vector<uint64_t> load(count, 0);
+			for (auto &f : files) {
+				unsigned int s = min_element(load.begin(), load.end()) - load.begin();
+				load[s] += f.first;
+				balanced[f.second] = s;
+			}
+		}
+		
+		// rel_path is the path relative to the source directory, as handed to path_to_list.
+		unsigned int shardOf(const string &rel_path) const {
+			auto it = balanced.find(rel_path);
+			if (it != balanced.end()) return it->second;
+			return stable_hash(rel_path) % count;
+		}
+		
+		bool mine(const string &rel_path) const {
+			return shardOf(rel_path) == index;
+		}
+	};
+	
+	// what a shard was given: its files, plus enough about the whole tree (file
+	// count and an order-independent checksum of every path) for a merge to
+	// notice a file nobody got.
+	struct Manifest {
+		unsigned int index = 0, count = 1;
+		uint64_t tree_files = 0, tree_sum = 0;
+		set<string> files;
+		
+		// call for every file in the tree, whoever it belongs to.
+		void see(const string &rel_path) {
+			tree_files++;
+			tree_sum += stable_hash(rel_path);
+		}
+		
+		bool save(const string &path) const {
+			string tmp_path = path + ".tmp";
+			ofstream ofile(tmp_path, ios::out|ios::trunc|ios::binary);
+			bencode::BencodeVal head(bencode::bencode_type::dict);
+			head["type"] = string("shard");
+			head["shard"] = (long long)index;
+			head["of"] = (long long)count;
+			head["tree files"] = (long long)tree_files;
+			head["tree sum"] = (long long)tree_sum;
+			ofile << journal::wrapRecord(head);
+			for (const string &f : files) {
+				bencode::BencodeVal rec(bencode::bencode_type::dict);
+				rec["type"] = string("file");
+				rec["path"] = f;
+				ofile << journal::wrapRecord(rec);
+			}
+			ofile.close();
+			if (!ofile || rename(tmp_path.c_str(), path.c_str())) {
+				perror("failed to write manifest");
+				return false;
+			}
+			return true;
+		}
+		
+		bool load(const string &path) {
+			bool head = false;
+			journal::readRecords(path, [&](const bencode::BencodeVal &rec) {
+				if (rec.at("type").getBytes() == "shard") {
+					index = rec.at("shard").getInteger();
+					count = rec.at("of").getInteger();
+					tree_files = rec.at("tree files").getInteger();
+					tree_sum = rec.at("tree sum").getInteger();
+					head = true;
+				} else {
+					files.insert(rec.at("path").getBytes());
+				}
+			});
+			return head;
+		}
+	};
+	
+	// combine every shard's manifest and index found in shard_dirs into one
+	// unsharded index and manifest in out_path, copying .torrent files over from
+	// any shard directory that isn't out_path.  returns false (having said why)
+	// if shards are missing, overlap, or didn't finish.
+	inline bool merge(const filesystem::path &out_path, const vector<filesystem::path> &shard_dirs) {
+		const string manifest_name = ".torrent_tree.manifest", index_name = ".torrent_tree.index";
+		bool ok = true;
+		// shard index -> its manifest and the directory it was found in.
+		map<unsigned int, pair<Manifest, filesystem::path>> shards;
+		map<unsigned int, filesystem::path> manifest_files;
+		Manifest merged;
+		map<string, unsigned int> owner;
+		file_index::FileIndex index;
+		
+		struct Found {
+			Manifest m;
+			filesystem::path dir, file;
+			filesystem::file_time_type mtime;
+		};
+		vector<Found> found;
+		set<filesystem::path> seen_dirs;
+		for (const filesystem::path &dir : shard_dirs) {
+			if (!seen_dirs.insert(filesystem::canonical(dir)).second) {
+				continue;
+			}
+			for (auto &entry : filesystem::directory_iterator(dir)) {
+				string name = entry.path().filename().string();
+				if (name.compare(0, manifest_name.size() + 1, manifest_name + ".") || entry.path().extension() == ".tmp") {
+					continue;
+				}
+				Found f;
+				if (!f.m.load(entry.path())) {
+					cerr << "Not a shard manifest: " << entry.path() << endl;
+					ok = false;
+					continue;
+				}
+				f.dir = dir;
+				f.file = entry.path();
+				f.mtime = entry.last_write_time();
+				found.push_back(f);
+			}
+		}
+		if (found.empty()) {
+			cerr << "No shard manifests found" << endl;
+			return false;
+		}
+		
+		// a shared save directory can still hold manifests from an earlier run
+		// split a different number of ways.  go with the newest run's count.
+		const Found *newest = &found[0];
+		for (const Found &f : found) {
+			if (f.mtime > newest->mtime) newest = &f;
+		}
+		unsigned int count = newest->m.count;
+		for (const Found &f : found) {
+			if (f.m.count != count) {
+				cerr << "Ignoring " << f.file << ", shard " << f.m.index << " of " << f.m.count
+					<< " when the newest shards are of " << count << "; delete it if it's from an earlier run" << endl;
+				continue;
+			}
+			if (shards.count(f.m.index)) {
+				cerr << "Shard " << f.m.index << " found twice: " << manifest_files[f.m.index] << " and "
+					<< f.file << "; delete whichever is from an earlier run" << endl;
+				ok = false;
+				continue;
+			}
+			shards[f.m.index] = {f.m, f.dir};
+			manifest_files[f.m.index] = f.file;
+		}
+		
+		const Manifest &first = shards.begin()->second.first;
+		for (unsigned int i = 0; i < first.count; i++) {
+			if (!shards.count(i)) {
+				cerr << "Missing shard " << i << " of " << first.count << endl;
+				ok = false;
+			}
+		}
+		for (auto &s : shards) {
+			const Manifest &m = s.second.first;
+			if (m.count != first.count || m.tree_files != first.tree_files || m.tree_sum != first.tree_sum) {
+				cerr << "Shard " << s.first << " saw a different tree than shard "
+					<< first.index << "; were they run against the same files?" << endl;
+				ok = false;
+			}
+			
+			file_index::FileIndex shard_index;
+			shard_index.load(s.second.second / (index_name + suffix(m.index, m.count)));
+			for (const string &f : m.files) {
+				auto o = owner.emplace(f, s.first);
+				if (!o.second) {
+					cerr << f << " is in both shard " << o.first->second << " and shard " << s.first << endl;
+					ok = false;
+					continue;
+				}
+				merged.see(f);
+				merged.files.insert(f);
+				
+				file_index::Entry e;
+				if (!shard_index.find(f, e)) {
+					cerr << "Shard " << s.first << " never finished " << f << endl;
+					ok = false;
+					continue;
+				}
+				index.set(f, e);
+			}
+		}
+		if (merged.tree_files != first.tree_files || merged.tree_sum != first.tree_sum) {
+			cerr << "Shards' files (" << merged.tree_files << ") don't add up to the tree's ("
+				<< first.tree_files << "); some weren't given to any shard" << endl;
+			ok = false;
+		}
+		if (!ok) {
+			return false;
+		}
+		
+		for (auto &s : shards) {
+			const filesystem::path &dir = s.second.second;
+			if (filesystem::equivalent(dir, out_path)) continue;
+			for (auto &entry : filesystem::recursive_directory_iterator(dir)) {
+				if (!entry.is_regular_file() || entry.path().extension() != ".torrent") continue;
+				filesystem::path dest = out_path / filesystem::relative(entry.path(), dir);
+				filesystem::create_directories(dest.parent_path());
+				filesystem::copy_file(entry.path(), dest, filesystem::copy_options::overwrite_existing);
+			}
+		}
+		
+		merged.index = 0;
+		merged.count = 1;
+		return merged.save(out_path / manifest_name) && index.save(out_path / index_name);
+	}
+}
+
+#endif
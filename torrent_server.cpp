@@ -0,0 +1,476 @@
+#include <iostream>
+#include <filesystem>
+#include <getopt.h>
+#include <set>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include "torrent_sync.hpp"
+
+using namespace std;
+
+void usage() {
+	cout << "Usage: torrent_server -[vq] [--ignore dir ...] [--bind address] [--port port] [--rescan seconds] <torrent directory>\n"
+		"\tServes every .torrent under \033[1mtorrent directory\033[0m (as written by\n"
+		"\ttorrent_tree) over HTTP, the way transmission_maintenance.py expects:\n"
+		"\t\t/torrents                all info_hashes, one per line\n"
+		"\t\t/torrent/<hash>.torrent  the torrent with that info_hash\n"
+		"\tEverything is held in memory, and \033[1mtorrent directory\033[0m is rescanned\n"
+		"\tperiodically, reading only the files that changed.\n\n"
+		"Options:\n"
+		"\t-v\n\t\tVerbose mode\n\n"
+		"\t-q\n\t\tQuiet mode - anti-verbose mode\n\n"
+		"\t--ignore dir\n"
+		"\t\tIf dir is found, do not recurse into it.\n\n"
+		"\t--bind address\n"
+		"\t\tAddress to listen on (default 127.0.0.1).  There's no TLS here; put\n"
+		"\t\tit behind something that does TLS if it leaves the box\n\n"
+		"\t--port port\n"
+		"\t\tPort to listen on (default 8081)\n\n"
+		"\t--rescan seconds\n"
+		"\t\tHow often to look for new/changed/removed torrents (default 60,\n"
+		"\t\tat most 86400)\n";
+}
+
+// one .torrent file as we last saw it.
+struct IndexEntry {
+	filesystem::file_time_type mtime;
+	uintmax_t size;
+	string hash; // hex
+	shared_ptr<const string> data;
+};
+
+// everything a request needs.  built whole on each rescan and swapped in,
+// so the event loop never waits on the filesystem.
+struct Index {
+	map<filesystem::path, IndexEntry> files;
+	map<string, shared_ptr<const string>> torrents; // hex info_hash -> file contents
+	shared_ptr<const string> list;
+};
+
+bool verbose = false;
+set<filesystem::path> ignored_dirs;
+string start_path;
+
+mutex index_lock;
+shared_ptr<const Index> current_index;
+
+shared_ptr<const Index> get_index() {
+	lock_guard<mutex> l(index_lock);
+	return current_index;
+}
+
+// walk start_path, only reading what's new or changed since prev.
+shared_ptr<const Index> build_index(const Index *prev) {
+	auto r = make_shared<Index>();
+	size_t read = 0;
+	torrent_sync::walk_tree(start_path, ignored_dirs,
+		[&](const filesystem::directory_entry &entry) {
+			if (entry.path().extension() != ".torrent") {
+				return;
+			}
+			error_code ec;
+			IndexEntry e;
+			e.mtime = entry.last_write_time(ec);
+			e.size = entry.file_size(ec);
+			if (ec) return;
+			
+			if (prev) {
+				auto it = prev->files.find(entry.path());
+				if (it != prev->files.end() && it->second.mtime == e.mtime && it->second.size == e.size) {
+					r->files[entry.path()] = it->second;
+					return;
+				}
+			}
+			try {
+				string data = torrent_sync::read_file(entry.path());
+				e.hash = torrent_sync::string_to_hex(torrent_sync::info_hash(bencode::BencodeVal::parse(data)));
+				e.data = make_shared<const string>(move(data));
+			} catch (...) {
+				cerr << "Failed to calculate info_hash for " << entry.path() << endl;
+				return;
+			}
+			read++;
+			r->files[entry.path()] = move(e);
+		},
+		[](const filesystem::path &t) {
+			if (verbose) {
+				cout << "Skipping ignored directory " << t << endl;
+			}
+		});
+	
+	for (auto &x : r->files) {
+		r->torrents[x.second.hash] = x.second.data;
+	}
+	string list;
+	list.reserve(r->torrents.size() * 41);
+	for (auto &x : r->torrents) {
+		list += x.first;
+		list += '\n';
+	}
+	r->list = make_shared<const string>(move(list));
+	if (verbose) {
+		cout << "Indexed " << r->torrents.size() << " torrents (" << read << " read from disk)" << endl;
+	}
+	return r;
+}
+
+void rescan_loop(unsigned int seconds) {
+	while (true) {
+		this_thread::sleep_for(chrono::seconds(seconds));
+		shared_ptr<const Index> prev = get_index();
+		try {
+			shared_ptr<const Index> next = build_index(prev.get());
+			lock_guard<mutex> l(index_lock);
+			current_index = next;
+		} catch (exception &e) {
+			// directory vanished or similar.  keep serving what we had.
+			cerr << "Rescan failed: " << e.what() << endl;
+		}
+	}
+}
+
+struct Connection {
+	string in;
+	string head;
+	shared_ptr<const string> body; // keeps the index's copy alive while we send it
+	size_t sent = 0;
+	bool responding = false;
+	chrono::steady_clock::time_point last_active;
+};
+
+// connections that haven't managed a full request (or taken a response) in this long get dropped.
+const auto idle_timeout = chrono::seconds(30);
+const size_t max_request = 8192;
+
+// --rescan at most a day apart.  any longer and it may as well never rescan.
+const long max_rescan = 86400;
+
+void respond(Connection &c, int status, const string &reason, const string &type,
+	shared_ptr<const string> body, bool head_only) {
+	
+	if (!body) body = make_shared<const string>(reason + "\n");
+	c.head = "HTTP/1.1 " + to_string(status) + " " + reason + "\r\n"
+		"Content-Type: " + type + "\r\n"
+		"Content-Length: " + to_string(body->size()) + "\r\n"
+		"Connection: close\r\n\r\n";
+	if (!head_only) c.body = body;
+	c.responding = true;
+}
+
+void handle_request(Connection &c) {
+	// only the request line matters to us.
+	string line = c.in.substr(0, c.in.find("\r\n"));
+	size_t sp1 = line.find(' '), sp2 = line.find(' ', sp1 + 1);
+	if (sp1 == string::npos || sp2 == string::npos) {
+		respond(c, 400, "Bad Request", "text/plain", nullptr, false);
+		return;
+	}
+	string method = line.substr(0, sp1);
+	string target = line.substr(sp1 + 1, sp2 - sp1 - 1);
+	target = target.substr(0, target.find('?'));
+	bool head_only = method == "HEAD";
+	if (verbose) {
+		cout << method << " " << target << endl;
+	}
+	if (method != "GET" && !head_only) {
+		respond(c, 405, "Method Not Allowed", "text/plain", nullptr, false);
+		return;
+	}
+	
+	shared_ptr<const Index> index = get_index();
+	const string prefix = "/torrent/", suffix = ".torrent";
+	if (target == "/torrents") {
+		respond(c, 200, "OK", "text/plain", index->list, head_only);
+	} else if (target.size() > prefix.size() + suffix.size() && !target.compare(0, prefix.size(), prefix)
+		&& !target.compare(target.size() - suffix.size(), suffix.size(), suffix)) {
+		
+		string hash = target.substr(prefix.size(), target.size() - prefix.size() - suffix.size());
+		for (char &ch : hash) ch = tolower(ch);
+		auto it = index->torrents.find(hash);
+		if (it == index->torrents.end()) {
+			respond(c, 404, "Not Found", "text/plain", nullptr, head_only);
+		} else {
+			respond(c, 200, "OK", "application/x-bittorrent", it->second, head_only);
+		}
+	} else {
+		respond(c, 404, "Not Found", "text/plain", nullptr, head_only);
+	}
+}
+
+// true once everything's been sent (or the client's gone).
+bool send_some(int fd, Connection &c) {
+	size_t total = c.head.size() + (c.body ? c.body->size() : 0);
+	while (c.sent < total) {
+		const char *p;
+		size_t len;
+		if (c.sent < c.head.size()) {
+			p = c.head.data() + c.sent;
+			len = c.head.size() - c.sent;
+		} else {
+			p = c.body->data() + (c.sent - c.head.size());
+			len = total - c.sent;
+		}
+		ssize_t w = send(fd, p, len, MSG_NOSIGNAL);
+		if (w < 0) {
+			if (errno == EINTR) continue;
+			return errno != EAGAIN && errno != EWOULDBLOCK;
+		}
+		c.sent += w;
+	}
+	return true;
+}
+
+// address is numeric, v4 or v6.  (no getaddrinfo: it doesn't play well with -static.)
+// the whole of s as a number from lo to hi, or false.
+bool parse_number(const char *s, long lo, long hi, long &n) {
+	char *end;
+	errno = 0;
+	n = strtol(s, &end, 10);
+	return !errno && end != s && !*end && n >= lo && n <= hi;
+}
+
+int listen_on(const string &address, unsigned short port) {
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	memset(&addr, 0, sizeof(addr));
+	struct sockaddr_in *v4 = (struct sockaddr_in *)&addr;
+	struct sockaddr_in6 *v6 = (struct sockaddr_in6 *)&addr;
+	if (inet_pton(AF_INET, address.c_str(), &v4->sin_addr) == 1) {
+		v4->sin_family = AF_INET;
+		v4->sin_port = htons(port);
+		addr_len = sizeof(*v4);
+	} else if (inet_pton(AF_INET6, address.c_str(), &v6->sin6_addr) == 1) {
+		v6->sin6_family = AF_INET6;
+		v6->sin6_port = htons(port);
+		addr_len = sizeof(*v6);
+	} else {
+		cerr << "Not an IP address: " << address << endl;
+		return -1;
+	}
+	
+	int fd = socket(addr.ss_family, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("failed to create socket");
+		return -1;
+	}
+	int one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(fd, (struct sockaddr *)&addr, addr_len) || listen(fd, SOMAXCONN)) {
+		perror("failed to listen");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int serve(int listen_fd) {
+	int ep = epoll_create1(EPOLL_CLOEXEC);
+	if (ep < 0) {
+		perror("epoll_create1");
+		return 5;
+	}
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = listen_fd;
+	epoll_ctl(ep, EPOLL_CTL_ADD, listen_fd, &ev);
+	
+	// out of fds (or memory), a pending connection can't be accepted, and the
+	// level-triggered listen fd would wake us up for it over and over.  stop
+	// watching it until a connection is dropped, or a second has gone by in
+	// case it's the rescan that's holding them.
+	bool accepting = true;
+	chrono::steady_clock::time_point paused_at;
+	auto set_accepting = [&](bool on) {
+		if (on == accepting) return;
+		accepting = on;
+		struct epoll_event lev;
+		lev.events = on ? EPOLLIN : 0;
+		lev.data.fd = listen_fd;
+		epoll_ctl(ep, EPOLL_CTL_MOD, listen_fd, &lev);
+	};
+	
+	map<int, Connection> conns;
+	auto drop = [&](int fd) {
+		epoll_ctl(ep, EPOLL_CTL_DEL, fd, nullptr);
+		close(fd);
+		conns.erase(fd);
+		set_accepting(true);
+	};
+	
+	struct epoll_event events[64];
+	while (true) {
+		int n = epoll_wait(ep, events, 64, accepting ? 5000 : 1000);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			perror("epoll_wait");
+			return 5;
+		}
+		auto now = chrono::steady_clock::now();
+		if (!accepting && now - paused_at >= chrono::seconds(1)) {
+			set_accepting(true);
+		}
+		for (int i = 0; i < n; i++) {
+			int fd = events[i].data.fd;
+			if (fd == listen_fd) {
+				int cfd;
+				while ((cfd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK|SOCK_CLOEXEC)) >= 0) {
+					ev.events = EPOLLIN|EPOLLRDHUP;
+					ev.data.fd = cfd;
+					epoll_ctl(ep, EPOLL_CTL_ADD, cfd, &ev);
+					conns[cfd].last_active = now;
+				}
+				if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+					perror("failed to accept connection");
+					paused_at = now;
+					set_accepting(false);
+				}
+				continue;
+			}
+			
+			auto it = conns.find(fd);
+			if (it == conns.end()) continue;
+			Connection &c = it->second;
+			c.last_active = now;
+			
+			if (!c.responding) {
+				char buff[4096];
+				ssize_t r;
+				while ((r = recv(fd, buff, sizeof(buff), 0)) > 0) {
+					c.in.append(buff, r);
+				}
+				bool gone = r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+				if (c.in.find("\r\n\r\n") != string::npos) {
+					handle_request(c);
+				} else if (c.in.size() > max_request) {
+					respond(c, 431, "Request Header Fields Too Large", "text/plain", nullptr, false);
+				} else if (gone) {
+					drop(fd);
+					continue;
+				}
+				if (c.responding) {
+					ev.events = EPOLLOUT;
+					ev.data.fd = fd;
+					epoll_ctl(ep, EPOLL_CTL_MOD, fd, &ev);
+				} else {
+					continue;
+				}
+			}
+			if (send_some(fd, c)) {
+				drop(fd);
+			}
+		}
+		
+		vector<int> idle;
+		for (auto &x : conns) {
+			if (now - x.second.last_active > idle_timeout) {
+				idle.push_back(x.first);
+			}
+		}
+		for (int fd : idle) {
+			drop(fd);
+		}
+	}
+}
+
+int main(int argc, char *argv[]) {
+	struct option long_options[] = {
+		{"ignore", required_argument, 0, 0},
+		{"bind", required_argument, 0, 'b'},
+		{"port", required_argument, 0, 'p'},
+		{"rescan", required_argument, 0, 'r'},
+		{0, 0, 0, 0}
+	};
+	string address = "127.0.0.1";
+	unsigned short port = 8081;
+	unsigned int rescan = 60;
+	int c, option_index;
+	while ((c = getopt_long(argc, argv, "vq", long_options, &option_index)) != -1) {
+		
+		switch (c) {
+			case 'v':
+				verbose = true;
+				break;
+			case 'q':
+				verbose = false;
+				break;
+			case 'b':
+				address = optarg;
+				break;
+			case 'p':
+				{
+					long n;
+					if (!parse_number(optarg, 1, 65535, n)) {
+						cerr << "Invalid port: " << optarg << endl;
+						usage();
+						return 1;
+					}
+					port = n;
+				}
+				break;
+			case 'r':
+				{
+					long n;
+					if (!parse_number(optarg, 1, max_rescan, n)) {
+						cerr << "--rescan needs to be a number of seconds from 1 to " << max_rescan << endl;
+						usage();
+						return 1;
+					}
+					rescan = n;
+				}
+				break;
+			case 0:
+				{
+					filesystem::path t = filesystem::absolute(optarg);
+					if (!t.has_filename()) {
+						t = t.parent_path();
+					}
+					
+					if (verbose) {
+						cout << "Adding ignored directory: " << t << endl;
+					}
+					
+					ignored_dirs.insert(t);
+				}
+				break;
+			default:
+				usage();
+				return 1;
+				break;
+		}
+	}
+	
+	if (argc != optind + 1) {
+		usage();
+		return 1;
+	}
+	start_path = argv[optind];
+	
+	if (!filesystem::is_directory(filesystem::status(start_path))) {
+		cerr << "No such directory: " << start_path << endl;
+		usage();
+		return 2;
+	}
+	if (start_path.back() == '/') start_path.pop_back();
+	
+	current_index = build_index(nullptr);
+	
+	int listen_fd = listen_on(address, port);
+	if (listen_fd < 0) {
+		return 3;
+	}
+	cout << "Serving " << current_index->torrents.size() << " torrents on " << address << ":" << port << endl;
+	
+	thread(rescan_loop, rescan).detach();
+	return serve(listen_fd);
+}
@@ -0,0 +1,415 @@
+#include <fstream>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <fcntl.h>
+#include <unistd.h>
+#include "torrent_sync.hpp"
+#include "sha1.hpp"
+
+using namespace std;
+
+namespace torrent_sync {
+	// how far ahead of the hasher to ask the kernel to read, and how much
+	// already-hashed data to let pile up in the page cache before dropping it.
+	const uint64_t readahead_window = (uint64_t)8 << 20;
+	
+	// sha1 of piece_length zero bytes.  every piece inside a hole hashes to this,
+	// and there's only ever a handful of piece lengths, so keep them around.
+	static string zero_piece_hash(uint64_t piece_length) {
+		static map<uint64_t, string> cache;
+		static mutex cache_lock;
+		lock_guard<mutex> l(cache_lock);
+		auto it = cache.find(piece_length);
+		if (it == cache.end()) {
+			it = cache.emplace(piece_length, sha1::hash(string(piece_length, '\0'))).first;
+		}
+		return it->second;
+	}
+	
+	// this function from fredoverflow on stackoverflow.  short and simple, I definitely am not gonna make a better one.
+	string string_to_hex(const string &input) {
+		static const char hex_digits[] = "0123456789abcdef";
+		
+		string output;
+		output.reserve(input.length() * 2);
+		for (unsigned char c : input) {
+			output.push_back(hex_digits[c >> 4]);
+			output.push_back(hex_digits[c & 15]);
+		}
+		return output;
+	}
+	
+	bencode::BencodeVal path_to_list(const string &path, const char sep) {
+		bencode::BencodeVal r(bencode::bencode_type::list);
+		
+		string cur_path;
+		for (size_t i = 0; i < path.size(); i++) {
+			if (path[i] == sep) {
+				if (cur_path.size()) {// leading slashes shouldn't result in an empty list item.
+					r.push_back(cur_path);
+					cur_path.clear();
+				}
+			} else {
+				cur_path += path[i];
+			}
+		}
+		r.push_back(cur_path);
+		return r;
+	}
+	
+	// floor(log2(x)), x > 0.
+	static unsigned int log2_floor(uint64_t x) {
+		return 63 - __builtin_clzll(x);
+	}
+	
+	// smallest power of 2 >= x, x > 0.
+	static uint64_t pow2_ceil(uint64_t x) {
+		return x == 1 ? 1 : (uint64_t)2 << log2_floor(x - 1);
+	}
+	
+	bool parse_size(const string &s, uint64_t &size) {
+		size_t used = 0;
+		unsigned long long n;
+		try {
+			n = stoull(s, &used);
+		} catch (...) {
+			return false;
+		}
+		unsigned int shift = 0;
+		string unit = s.substr(used);
+		if (unit == "K" || unit == "KiB") {
+			shift = 10;
+		} else if (unit == "M" || unit == "MiB") {
+			shift = 20;
+		} else if (unit == "G" || unit == "GiB") {
+			shift = 30;
+		} else if (unit != "") {
+			return false;
+		}
+		if (s[0] == '-' || n > (~(uint64_t)0 >> shift)) {
+			return false;
+		}
+		size = (uint64_t)n << shift;
+		return true;
+	}
+	
+	bool PieceLengthPolicy::parse(const string &spec) {
+		PieceLengthPolicy p;
+		string first = spec.substr(0, spec.find(',')), rest;
+		if (first.size() < spec.size()) {
+			rest = spec.substr(first.size() + 1);
+		}
+		
+		if (first == "default") {
+			p.k = kind::legacy;
+		} else if (!first.compare(0, 11, "max-pieces=")) {
+			p.k = kind::max_pieces;
+			p.max = (uint64_t)16 << 20;
+			if (!parse_size(first.substr(11), p.pieces) || !p.pieces) {
+				return false;
+			}
+		} else if (parse_size(first, p.max) && rest.empty()) {
+			p.k = kind::fixed;
+		} else {
+			return false;
+		}
+		if (!rest.empty() && (rest.compare(0, 4, "max=") || !parse_size(rest.substr(4), p.max))) {
+			return false;
+		}
+		
+		// pieces are read whole into memory, so anything past 1G is a mistake.
+		if (p.max < min_length || p.max > ((uint64_t)1 << 30) || (p.max & (p.max - 1))) {
+			return false;
+		}
+		*this = p;
+		return true;
+	}
+	
+	uint64_t PieceLengthPolicy::pieceLength(uint64_t file_size) const {
+		uint64_t r = 0;
+		switch (k) {
+			case kind::legacy:
+				// 5120=102400/20, looks to keep .torrent files <100K with minimum
+				// possible piece length, holding a power of 2.
+				if (file_size / 5120) {
+					r = (uint64_t)2 << log2_floor(file_size / 5120);
+				}
+				break;
+			case kind::max_pieces:
+				if (file_size) {
+					r = pow2_ceil((file_size - 1) / pieces + 1);
+				}
+				break;
+			case kind::fixed:
+				return max;
+		}
+		return std::max(std::min(r, max), min_length);
+	}
+	
+	string PieceLengthPolicy::describe() const {
+		string size = max % (1 << 30) == 0 ? to_string(max >> 30) + "G"
+			: max % (1 << 20) == 0 ? to_string(max >> 20) + "M"
+			: to_string(max >> 10) + "K";
+		switch (k) {
+			case kind::legacy:
+				return "default,max=" + size;
+			case kind::max_pieces:
+				return "max-pieces=" + to_string(pieces) + ",max=" + size;
+			default:
+				return size;
+		}
+	}
+	
+	uint64_t default_piece_length(uint64_t file_size) {
+		return PieceLengthPolicy().pieceLength(file_size);
+	}
+	
+	// one page-aligned read buffer per thread, grown to the biggest piece asked
+	// for and kept from file to file instead of allocated for each.
+	static char *piece_buffer(uint64_t length) {
+		struct Buffer {
+			char *data = nullptr;
+			uint64_t size = 0;
+			~Buffer() {
+				free(data);
+			}
+		};
+		static thread_local Buffer b;
+		if (b.size < length) {
+			free(b.data);
+			b.data = nullptr;
+			b.size = 0;
+			if (posix_memalign((void **)&b.data, 4096, length)) {
+				throw bad_alloc();
+			}
+			b.size = length;
+		}
+		return b.data;
+	}
+	
+	void hash_pieces(const filesystem::path &path, uint64_t size, uint64_t piece_length,
+		string &pieces, uint64_t offset,
+		const function<void(uint64_t offset, const string &pieces)> &on_piece, bool skip_holes) {
+		
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0) {
+			throw runtime_error("failed to open " + path.string() + ": " + strerror(errno));
+		}
+		// we're reading start to finish, once.  let the kernel read ahead hard,
+		// and drop pages behind us so a full run doesn't push everyone else's
+		// cache out of memory.
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		uint64_t advised = offset, dropped = offset;
+		// stay at least a couple of pieces ahead, for big pieces.
+		uint64_t window = max(readahead_window, 2 * piece_length);
+		
+		// [data_start, data_end) is the next stretch of the file that's actually
+		// allocated, at or after offset.  anything before data_start is a hole and
+		// reads back as zeros, so there's no need to read it at all.  filesystems
+		// without SEEK_DATA support report the whole file as data, which is just
+		// the plain path.
+		uint64_t data_start = 0, data_end = 0;
+		
+		char *buff = piece_buffer(piece_length);
+		while (offset < size) {
+			size_t want = min(piece_length, size - offset), got = 0;
+			
+			if (skip_holes && offset >= data_end) {
+				off_t d = lseek(fd, offset, SEEK_DATA);
+				if (d >= 0) {
+					off_t h = lseek(fd, d, SEEK_HOLE);
+					data_start = d;
+					data_end = h < 0 ? size : h;
+				} else if (errno == ENXIO) {
+					// nothing but hole from here on.
+					data_start = data_end = size;
+				} else {
+					skip_holes = false;
+				}
+			}
+			if (skip_holes && offset + want <= data_start) {
+				pieces += want == piece_length ? zero_piece_hash(piece_length) : sha1::hash(string(want, '\0'));
+				offset += want;
+				if (on_piece) {
+					on_piece(offset, pieces);
+				}
+				continue;
+			}
+			
+			if (advised < size && advised < offset + window / 2) {
+				advised = max(advised, offset);
+				posix_fadvise(fd, advised, window, POSIX_FADV_WILLNEED);
+				advised += window;
+			}
+			
+			while (got < want) {
+				ssize_t r = pread(fd, &buff[got], want - got, offset + got);
+				if (r < 0 && errno == EINTR) continue;
+				if (r <= 0) break;
+				got += r;
+			}
+			if (got != want) {
+				// error, or the file shrank out from under us.  either way, this torrent would be garbage.
+				posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+				close(fd);
+				throw runtime_error("failed to read " + path.string() + " at byte " + to_string(offset + got));
+			}
+			
+			// the last piece may be short.
+			pieces += sha1::hash(buff, got);
+			offset += got;
+			
+			if (offset - dropped >= window) {
+				posix_fadvise(fd, dropped, offset - dropped, POSIX_FADV_DONTNEED);
+				dropped = offset;
+			}
+			if (on_piece) {
+				on_piece(offset, pieces);
+			}
+		}
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+	
+	string hash_piece(const filesystem::path &path, uint64_t offset, uint64_t length) {
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0) {
+			throw runtime_error("failed to open " + path.string() + ": " + strerror(errno));
+		}
+		char *buff = piece_buffer(length);
+		size_t got = 0;
+		while (got < length) {
+			ssize_t r = pread(fd, &buff[got], length - got, offset + got);
+			if (r < 0 && errno == EINTR) continue;
+			if (r <= 0) break;
+			got += r;
+		}
+		close(fd);
+		if (got != length) {
+			throw runtime_error("failed to read " + path.string() + " at byte " + to_string(offset + got));
+		}
+		return sha1::hash(buff, length);
+	}
+	
+	bencode::BencodeVal make_torrent(const string &name, const string &announce, const string &rel_path,
+		uint64_t length, uint64_t piece_length, const string &pieces) {
+		
+		bencode::BencodeVal torrent(bencode::bencode_type::dict);
+		bencode::BencodeVal info(bencode::bencode_type::dict);
+		torrent["announce"] = announce;
+		info["name"] = name;
+		info["piece length"] = (long long)piece_length;
+		bencode::BencodeVal file(bencode::bencode_type::dict);
+		file["path"] = path_to_list(rel_path);
+		file["length"] = (long long)length;
+		info["files"] = vector<bencode::BencodeVal> {file};
+		info["pieces"] = pieces;
+		info["private"] = 1;
+		torrent["info"] = info;
+		return torrent;
+	}
+	
+	bencode::BencodeVal create_torrent(const filesystem::path &path, const string &rel_path,
+		const string &name, const string &announce, const PieceLengthPolicy &policy) {
+		
+		uint64_t size = filesystem::file_size(path);
+		uint64_t piece_length = policy.pieceLength(size);
+		string pieces;
+		hash_pieces(path, size, piece_length, pieces);
+		return make_torrent(name, announce, rel_path, size, piece_length, pieces);
+	}
+	
+	string info_hash(const bencode::BencodeVal &torrent) {
+		return sha1::hash(torrent.at("info").toString());
+	}
+	
+	string info_hash(const filesystem::path &torrent_file) {
+		return info_hash(bencode::BencodeVal::parse(read_file(torrent_file)));
+	}
+	
+	string read_file(const filesystem::path &p) {
+		ifstream f;
+		f.exceptions(ifstream::failbit|ifstream::badbit);
+		f.open(p, ios::in|ios::binary|ios::ate);
+		
+		auto size = f.tellg();
+		f.seekg(0);
+		string buff(size, '\0');
+		f.read(&buff[0], size);
+		f.close();
+		return buff;
+	}
+	
+	// marker file recording a flatten_tree directory's fan-out.
+	static const char fanout_file[] = ".fanout";
+	
+	bool is_info_hash(const string &hex) {
+		return hex.size() == 40 && all_of(hex.begin(), hex.end(), [](char c) {
+			return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f');
+		});
+	}
+	
+	filesystem::path torrent_path(const filesystem::path &root, const string &hex, unsigned int levels) {
+		if (!is_info_hash(hex)) {
+			throw invalid_argument("not an info_hash: " + hex);
+		}
+		filesystem::path r = root;
+		for (unsigned int i = 0; i < levels && i * 2 + 2 <= hex.size(); i++) {
+			r /= hex.substr(i * 2, 2);
+		}
+		return r / (hex + ".torrent");
+	}
+	
+	unsigned int get_fanout(const filesystem::path &root) {
+		ifstream f(root / fanout_file);
+		unsigned int levels = 0;
+		if (!(f >> levels) || levels > max_fanout) {
+			return 0;
+		}
+		return levels;
+	}
+	
+	void set_fanout(const filesystem::path &root, unsigned int levels) {
+		filesystem::path p = root / fanout_file;
+		if (!levels) {
+			filesystem::remove(p);
+			return;
+		}
+		filesystem::path tmp = p;
+		tmp += ".tmp";
+		ofstream f;
+		f.exceptions(ofstream::failbit|ofstream::badbit);
+		f.open(tmp, ios::out|ios::trunc);
+		f << levels << endl;
+		f.close();
+		filesystem::rename(tmp, p);
+	}
+	
+	void walk_tree(const filesystem::path &root, const set<filesystem::path> &ignored_dirs,
+		const function<void(const filesystem::directory_entry &)> &on_file,
+		const function<void(const filesystem::path &)> &on_ignored) {
+		
+		vector<filesystem::path> path_stack {root};
+		for (size_t i = 0; i < path_stack.size(); i++) {
+			for (auto &entry : filesystem::directory_iterator(path_stack[i])) {
+				if (entry.is_regular_file()) {
+					
+					on_file(entry);
+				
+				} else if (entry.is_directory()) {
+					filesystem::path t = filesystem::absolute(entry.path());
+					if (ignored_dirs.count(t)) {
+						if (on_ignored) {
+							on_ignored(t);
+						}
+						continue;
+					}
+					path_stack.push_back(entry.path());
+				}
+			}
+		}
+	}
+}
@@ -0,0 +1,120 @@
+// libtorrent_sync: the bits of torrent_tree and flatten_tree worth having
+// outside of them.  link against libtorrent_sync.a.
+#ifndef TORRENT_SYNC_HPP
+#define TORRENT_SYNC_HPP
+
+#include <string>
+#include <set>
+#include <filesystem>
+#include <functional>
+#include "bencode.hpp"
+
+using namespace std;
+
+namespace torrent_sync {
+	// "abc" -> "616263"
+	string string_to_hex(const string &input);
+	
+	// "a/b/c" -> ["a", "b", "c"], as used in a torrent's files list.
+	bencode::BencodeVal path_to_list(const string &path, const char sep = '/');
+	
+	// how a file's piece length is picked.  always a power of 2, at least 4K.
+	//   legacy:     the original rule, twice the largest power of 2 under size/5120,
+	//               which keeps .torrent files under 100K until it hits max (1M).
+	//   max_pieces: the smallest piece length giving at most pieces pieces, up to
+	//               max (16M unless told otherwise).
+	//   fixed:      max, for every file.
+	class PieceLengthPolicy {
+		public:
+		
+		enum class kind { legacy, max_pieces, fixed };
+		
+		static constexpr uint64_t min_length = 4096;
+		
+		PieceLengthPolicy() {}
+		PieceLengthPolicy(kind k, uint64_t max, uint64_t pieces = 0) : k(k), max(max), pieces(pieces) {}
+		
+		// "default", "default,max=SIZE", "max-pieces=N", "max-pieces=N,max=SIZE",
+		// or a size for fixed.  sizes take K, M and G suffixes (powers of 1024).
+		// returns false, leaving the policy alone, if spec doesn't make sense.
+		bool parse(const string &spec);
+		
+		uint64_t pieceLength(uint64_t file_size) const;
+		
+		// spec that parses back to this policy.
+		string describe() const;
+		
+		private:
+		
+		kind k = kind::legacy;
+		uint64_t max = (uint64_t)1 << 20;
+		uint64_t pieces = 0;
+	};
+	
+	// "4M" -> 4194304.  returns false on anything else.
+	bool parse_size(const string &s, uint64_t &size);
+	
+	// piece length under the default policy.
+	uint64_t default_piece_length(uint64_t file_size);
+	
+	// hashes path from offset (must be piece aligned) up to size, appending each
+	// piece's hash to pieces.  on_piece, if given, is called after each piece with
+	// the offset hashed up to so far.  with skip_holes, pieces lying entirely in a
+	// hole of a sparse file get the all-zero hash without being read.  throws
+	// runtime_error if the file can't be read in full.
+	void hash_pieces(const filesystem::path &path, uint64_t size, uint64_t piece_length,
+		string &pieces, uint64_t offset = 0,
+		const function<void(uint64_t offset, const string &pieces)> &on_piece = nullptr,
+		bool skip_holes = true);
+	
+	// sha1 of length bytes of path, starting at offset.  throws runtime_error
+	// if they can't all be read.
+	string hash_piece(const filesystem::path &path, uint64_t offset, uint64_t length);
+	
+	// puts together a single-file torrent (in a directory named name, so clients
+	// keep the original hierarchy) from already-computed pieces.
+	bencode::BencodeVal make_torrent(const string &name, const string &announce, const string &rel_path,
+		uint64_t length, uint64_t piece_length, const string &pieces);
+	
+	// reads and hashes path, returning the finished torrent.
+	bencode::BencodeVal create_torrent(const filesystem::path &path, const string &rel_path,
+		const string &name, const string &announce, const PieceLengthPolicy &policy = PieceLengthPolicy());
+	
+	// raw 20-byte info_hash of a torrent.  string_to_hex it for the usual form.
+	string info_hash(const bencode::BencodeVal &torrent);
+	
+	// same, for a .torrent file on disk.  throws if it can't be read or parsed.
+	string info_hash(const filesystem::path &torrent_file);
+	
+	// reads a whole file into memory.  throws if it can't.
+	string read_file(const filesystem::path &p);
+	
+	// flatten_tree directories can fan out into subdirectories named for the
+	// leading bytes of each info_hash, so no one directory gets millions of
+	// entries.  levels = 2 puts abcdef... at root/ab/cd/abcdef....torrent.
+	const unsigned int max_fanout = 4;
+	
+	// 40 lowercase hex digits, as string_to_hex makes of an info_hash.
+	bool is_info_hash(const string &hex);
+	
+	// where the torrent with hex info_hash (as from string_to_hex) lives.  throws
+	// invalid_argument unless is_info_hash(hex), so nothing else (../ and all)
+	// can be turned into a path.
+	filesystem::path torrent_path(const filesystem::path &root, const string &hex, unsigned int levels);
+	
+	// the fan-out root is laid out with, as recorded by set_fanout.  0 (flat)
+	// if it's never been set.
+	unsigned int get_fanout(const filesystem::path &root);
+	
+	// records root's fan-out.  throws if it can't.
+	void set_fanout(const filesystem::path &root, unsigned int levels);
+	
+	// breadth-first walk of root, calling on_file for every regular file.
+	// directories in ignored_dirs (absolute paths) aren't recursed into, and
+	// are handed to on_ignored if it's given.
+	void walk_tree(const filesystem::path &root, const set<filesystem::path> &ignored_dirs,
+		const function<void(const filesystem::directory_entry &)> &on_file,
+		const function<void(const filesystem::path &)> &on_ignored = nullptr);
+}
+
+#endif
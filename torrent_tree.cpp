@@ -1,16 +1,22 @@
 #include <iostream>
 #include <filesystem>
 #include <fstream>
-#include <cmath>
 #include <getopt.h>
 #include <set>
+#include <mutex>
+#include <random>
 #include "bencode.hpp"
-#include "sha1.hpp"
+#include "torrent_sync.hpp"
+#include "journal.hpp"
+#include "file_index.hpp"
+#include "shard.hpp"
+#include "io_sched.hpp"
 
 using namespace std;
 
 void usage() {
-	cout << "Usage: torrent_tree -[vquf] [--ignore file_or_dir ...] <source directory> <save directory> <announce URI>\n"
+	cout << "Usage: torrent_tree -[vquf] [--ignore file_or_dir ...] [--resume] [--journal file] [--per-device n] [--no-sparse] [--piece-length policy] [--shard i/N [--shard-index file]] <source directory> <save directory> <announce URI>\n"
+		"       torrent_tree --merge <save directory> [shard save directory ...]\n"
 		"\tCreates a series of torrent files to enable full replication of the \n"
 		"\thierarchy at \033[1msource directory\033[0m, with all files saved to \n"
 		"\t\033[1msave directory\033[0m.  \033[1mannounce URI\033[0m is listed \n"
@@ -19,38 +25,77 @@ void usage() {
 		"\t-v\n\t\tVerbose mode\n\n"
 		"\t-q\n\t\tQuiet mode - anti-verbose mode\n\n"
 		"\t-u\n\t\tUpdate mode - Existing .torrent files will be overwritten IF\n"
-		"\t\tthe source file is newer than the existing .torrent\n\n"
+		"\t\tthe source file is newer than the existing .torrent.  A file that has\n"
+		"\t\tonly been appended to since only has its new data hashed\n\n"
 		"\t-f\n\t\tForce overwrite - All existing .torrent files will be overwritten\n\n"
 		"\t--ignore file_or_dir\n"
 		"\t\tIf file_or_dir is a directory, do not recurse into it.  If file_or_dir\n"
-		"\t\tis a file, do not create a .torrent entry for it\n";
-}
-
-// helper function for path conversions.
-bencode::BencodeVal path_to_list(const string &path, const char sep = '/') {
-	bencode::BencodeVal r(bencode::bencode_type::list);
-	
-	string cur_path;
-	for (size_t i = 0; i < path.size(); i++) {
-		if (path[i] == sep) {
-			if (cur_path.size()) {// leading slashes shouldn't result in an empty list item.
-				r.push_back(cur_path);
-				cur_path.clear();
-			}
-		} else {
-			cur_path += path[i];
-		}
-	}
-	r.push_back(cur_path);
-	return r;
+		"\t\tis a file, do not create a .torrent entry for it\n\n"
+		"\t--resume\n"
+		"\t\tPick up an interrupted run from its journal.  Files finished last time\n"
+		"\t\tare skipped, and large files continue hashing from their last checkpoint,\n"
+		"\t\tunless they've changed since\n\n"
+		"\t--journal file\n"
+		"\t\tWhere to keep the checkpoint journal.  Defaults to\n"
+		"\t\t<save directory>/.torrent_tree.journal\n\n"
+		"\t--per-device n\n"
+		"\t\tHow many files to read at once from each disk (default 1).  Every\n"
+		"\t\tdisk under source directory is read in parallel; raise this for SSDs\n"
+		"\t\t(at most 64)\n\n"
+		"\t--no-sparse\n"
+		"\t\tRead and hash every byte, even in holes of sparse files.  Normally\n"
+		"\t\tpieces entirely inside a hole are known to be zeros and aren't read\n\n"
+		"\t--piece-length policy\n"
+		"\t\tHow to pick each file's piece length, always a power of 2:\n"
+		"\t\t  default               twice the largest power of 2 under size/5120,\n"
+		"\t\t                        up to 1M (the original behaviour)\n"
+		"\t\t  default,max=SIZE      the same, but up to SIZE instead\n"
+		"\t\t  max-pieces=N[,max=SIZE]\n"
+		"\t\t                        the smallest piece length giving at most N\n"
+		"\t\t                        pieces, up to SIZE (default 16M)\n"
+		"\t\t  SIZE                  SIZE for every file\n"
+		"\t\tSIZE takes K, M or G (powers of 1024), from 4K to 1G.  Big files get\n"
+		"\t\tsmaller .torrents, and are lighter on clients, with bigger pieces\n\n"
+		"\t--shard i/N\n"
+		"\t\tOnly handle shard i (0 to N-1) of the files, so N machines seeing the\n"
+		"\t\tsame source directory can split the work.  Files go to shards by a\n"
+		"\t\thash of their relative path.  Each shard writes a manifest of its\n"
+		"\t\tfiles, and its own journal and index, alongside its .torrent files\n\n"
+		"\t--shard-index file\n"
+		"\t\tBalance shards by file size, using a previous run's .torrent_tree.index.\n"
+		"\t\tEvery shard must be given the same file\n\n"
+		"\t--merge\n"
+		"\t\tCheck the shard manifests in save directory (and any shard save\n"
+		"\t\tdirectories given) cover every file exactly once and every shard\n"
+		"\t\tfinished, then combine them into one index and manifest in save\n"
+		"\t\tdirectory, copying in .torrent files from the other directories\n";
 }
 
 #define OVERWRITE_NONE 0
 #define OVERWRITE_NEWER 1
 #define OVERWRITE_ALL 2
 	
+// files bigger than this get their piece hashes checkpointed to the journal,
+// once per this many bytes hashed.
+const uint64_t checkpoint_interval = (uint64_t)1 << 30;
+
+// how many of a grown file's old pieces to re-hash at random, on top of its old
+// last piece, before trusting it was only appended to.
+const int append_samples = 4;
+
+// more readers than this on one disk is surely a typo; each is a thread.
+const long max_per_device = 64;
+
 bool verbose = false;
 short overwrite = OVERWRITE_NONE;
+bool resume = false;
+unsigned int per_device = 1;
+bool skip_holes = true;
+torrent_sync::PieceLengthPolicy piece_policy;
+journal::Journal run_journal;
+file_index::FileIndex run_index;
+shard::Plan plan;
+mutex out_lock;
 
 set<filesystem::path> ignored_dirs;
 string start_path;
@@ -58,25 +103,131 @@ filesystem::path out_path;
 string announce_url;
 string torrent_file_name;
 
-void process_file(filesystem::directory_entry entry) {
+// files are processed from several threads at once.  keep their lines whole.
+template <typename... T>
+void say(ostream &o, const T &...args) {
+	lock_guard<mutex> l(out_lock);
+	(o << ... << args) << endl;
+}
+
+// path relative to the source directory, as it appears in the torrent.
+string relative_path(const filesystem::path &p) {
+	return p.string().erase(0, start_path.size() + 1);
+}
+
+// whether the .torrent at path is really there: not empty, and parses.
+bool torrent_intact(const filesystem::path &path) {
+	try {
+		string data = torrent_sync::read_file(path);
+		return data.size() && bencode::BencodeVal::parse(data).at("info").getType() == bencode::bencode_type::dict;
+	} catch (exception &) {
+		return false;
+	}
+}
+
+// a file that's only grown since its .torrent was written keeps all of its old
+// full pieces.  make sure that's really what happened (the old, partial last
+// piece and a few old pieces at random still match) before trusting it.  on
+// success, pieces and offset are where to carry on hashing from.
+bool reuse_appended(const filesystem::directory_entry &entry, const string &rel_path, const journal::FileId &id,
+	uint64_t piece_length, const filesystem::path &torrent_path, string &pieces, uint64_t &offset) {
+	
+	file_index::Entry prior;
+	if (!run_index.find(rel_path, prior) || prior.id.device != id.device || prior.id.inode != id.inode
+		|| prior.piece_length != piece_length || prior.id.size >= id.size) {
+		return false;
+	}
+	
+	string old_pieces;
+	try {
+		bencode::BencodeVal old = bencode::BencodeVal::parse(torrent_sync::read_file(torrent_path));
+		const bencode::BencodeVal &info = old.at("info");
+		if ((uint64_t)info.at("piece length").getInteger() != piece_length
+			|| (uint64_t)info.at("files")[(size_t)0].at("length").getInteger() != prior.id.size) {
+			return false;
+		}
+		old_pieces = info.at("pieces").getBytes();
+	} catch (exception &e) {
+		return false;
+	}
+	uint64_t full = prior.id.size / piece_length;
+	if (old_pieces.size() != (full + (prior.id.size % piece_length ? 1 : 0)) * 20) {
+		return false;
+	}
+	
+	vector<uint64_t> check;
+	if (prior.id.size % piece_length) {
+		check.push_back(full);
+	}
+	mt19937_64 rng(random_device{}());
+	for (int i = 0; i < append_samples && full; i++) {
+		check.push_back(rng() % full);
+	}
+	try {
+		for (uint64_t n : check) {
+			uint64_t len = min(piece_length, prior.id.size - n * piece_length);
+			if (torrent_sync::hash_piece(entry.path(), n * piece_length, len) != old_pieces.substr(n * 20, 20)) {
+				if (verbose) {
+					say(cout, entry.path(), " changed at piece ", n, ", not just appended to");
+				}
+				return false;
+			}
+		}
+	} catch (runtime_error &e) {
+		return false;
+	}
+	
+	pieces = old_pieces.substr(0, full * 20);
+	offset = full * piece_length;
+	return true;
+}
+
+void process_file(const filesystem::directory_entry &entry) {
 	if (verbose) {
-		cout << "Processing " << entry.path() << endl;
+		say(cout, "Processing ", entry.path());
 	}
 	
 	filesystem::path file_path = out_path / entry.path().relative_path().replace_extension(".torrent");
+	string rel_path = relative_path(entry.path());
+	journal::FileId id;
+	if (!journal::identify(entry.path(), id)) {
+		perror("failed to stat file");
+		return;
+	}
+	
+	// the journal only says the .torrent was renamed into place, so check it
+	// actually made it to disk before believing it.  one that didn't is redone
+	// whatever -u/-f say, as its (empty) .torrent looks newer than the file.
+	bool redo = false;
+	if (resume && run_journal.finished(rel_path, id)) {
+		if (torrent_intact(file_path)) {
+			if (verbose) {
+				say(cout, "Skipping ", file_path, " - finished before resume");
+			}
+			run_index.set(rel_path, {id, piece_policy.pieceLength(id.size)});
+			return;
+		}
+		redo = true;
+	}
+	
 	filesystem::file_status out_status = filesystem::status(file_path);
 	// this will later be based on a command-line argument.
 	if (filesystem::exists(out_status)) {
 		bool skip = true;
-		if (overwrite == OVERWRITE_ALL) {
+		if (redo) {
 			if (verbose) {
-				cout << "Would skip " << file_path << ", but -f specified" << endl;
+				say(cout, "Would skip ", file_path, ", but it didn't survive the interrupted run");
+			}
+			skip = false;
+		} else if (overwrite == OVERWRITE_ALL) {
+			if (verbose) {
+				say(cout, "Would skip ", file_path, ", but -f specified");
 			}
 			skip = false;
 		} else if (overwrite == OVERWRITE_NEWER) {
 			if (filesystem::last_write_time(file_path) < filesystem::last_write_time(entry.path())) {
 				if (verbose) {
-					cout << "Would skip " << file_path << ", but -u specified" << endl;
+					say(cout, "Would skip ", file_path, ", but -u specified");
 				}
 				skip = false;
 			}
@@ -84,67 +235,102 @@ void process_file(filesystem::directory_entry entry) {
 		
 		if (skip) {
 			if (verbose) {
-				cout << "Skipping " << file_path << " - already exists" << endl;
+				say(cout, "Skipping ", file_path, " - already exists");
+			}
+			if (overwrite == OVERWRITE_NEWER) {
+				// the .torrent is newer than the file, so it's of the file as it is now.
+				run_index.set(rel_path, {id, piece_policy.pieceLength(id.size)});
+			} else {
+				run_index.keep(rel_path);
 			}
 			return;
-		} else {
-			// time to get destructive.  In case this was a directory before (okay, satan),
-			// we're going to delete recursively.
-			filesystem::remove_all(file_path);
 		}
 	}
 	
-	bencode::BencodeVal torrent(bencode::bencode_type::dict);
-	bencode::BencodeVal info(bencode::bencode_type::dict);
-	torrent["announce"] = announce_url;
-	info["name"] = torrent_file_name;
-	uint64_t file_size = filesystem::file_size(entry.path());
-	// 5120=102400/20, looks to keep .torrent files <100K with minimum
-	// possible piece length, holding a power of 2.
-	uint64_t piece_length = max(
-		min(
-			(uint64_t)1048576,
-			(uint64_t)exp2((int)log2(file_size / 5120) + 1)),
-		(uint64_t)4096);
-	info["piece length"] = piece_length;
-	bencode::BencodeVal file(bencode::bencode_type::dict);
-	file["path"] = path_to_list(entry.path().string().erase(0, start_path.size() + 1));
-	file["length"] = file_size;
-	info["files"] = vector<bencode::BencodeVal> {file};
-	info["pieces"] = string();
-	info["private"] = 1;
-	
-	ifstream ifile(entry.path(), ios::in|ios::binary);
-	if (!ifile) {
-		perror("failed to open file");
-	}
-	string buff(piece_length, '\0');
-	while (ifile.read(&buff[0], piece_length)) {
-		info["pieces"] += sha1::hash(buff);
-	}
-	if (ifile.eof()) {
-		// loop finished with data left.  add that data.
-		buff.resize(ifile.gcount());
-		if (buff.size()) {
-			info["pieces"] += sha1::hash(buff);
+	uint64_t file_size = id.size;
+	uint64_t piece_length = piece_policy.pieceLength(file_size);
+	
+	// pieces covers [0, offset).  resuming picks up both from the journal.
+	string pieces;
+	uint64_t offset = 0;
+	journal::Partial p;
+	if (resume && run_journal.resumePoint(rel_path, id, piece_length, p)) {
+		if (verbose) {
+			say(cout, "Resuming ", entry.path(), " at byte ", p.offset);
+		}
+		pieces = move(p.pieces);
+		offset = p.offset;
+	} else {
+		if (overwrite == OVERWRITE_NEWER && filesystem::exists(out_status)
+			&& reuse_appended(entry, rel_path, id, piece_length, file_path, pieces, offset)) {
+			if (verbose) {
+				say(cout, "Appending to ", file_path, " from byte ", offset);
+			}
+		}
+		if (file_size > checkpoint_interval) {
+			run_journal.begin(rel_path, id, piece_length);
+			if (offset) {
+				run_journal.checkpoint(rel_path, offset, pieces);
+			}
 		}
 	}
-	torrent["info"] = info;
+	size_t checkpointed = pieces.size();
+	
+	try {
+		torrent_sync::hash_pieces(entry.path(), file_size, piece_length, pieces, offset,
+			[&](uint64_t offset, const string &pieces) {
+				if ((pieces.size() - checkpointed) / 20 * piece_length >= checkpoint_interval) {
+					run_journal.checkpoint(rel_path, offset, pieces.substr(checkpointed));
+					checkpointed = pieces.size();
+				}
+			}, skip_holes);
+	} catch (runtime_error &e) {
+		say(cerr, e.what());
+		return;
+	}
+	bencode::BencodeVal torrent = torrent_sync::make_torrent(torrent_file_name, announce_url,
+		rel_path, file_size, piece_length, pieces);
 	
 	if (verbose) {
-		cout << "Creating " << file_path << endl;
+		say(cout, "Creating ", file_path);
 	}
+	// write alongside and rename over, so dying partway never leaves a
+	// truncated .torrent that a later run would happily skip.  the machine going
+	// down is covered by the journal, which syncs the save directory before its
+	// finish records land.
 	filesystem::create_directories(file_path.parent_path());
-	ofstream ofile(file_path, ios::out|ios::trunc);
+	filesystem::path tmp_path = file_path;
+	tmp_path += ".tmp";
+	ofstream ofile(tmp_path, ios::out|ios::trunc);
 	ofile << torrent.toString();
 	ofile.close();
+	if (!ofile) {
+		say(cerr, "Failed to write ", tmp_path);
+		return;
+	}
+	// time to get destructive.  In case this was a directory before (okay, satan),
+	// we're going to delete recursively.
+	filesystem::remove_all(file_path);
+	filesystem::rename(tmp_path, file_path);
+	run_journal.finish(rel_path, id);
+	run_index.set(rel_path, {id, piece_length});
 }
 
 int main(int argc, char *argv[]) {
 	struct option long_options[] = {
 		{"ignore", required_argument, 0, 0},
+		{"resume", no_argument, 0, 'r'},
+		{"journal", required_argument, 0, 'j'},
+		{"per-device", required_argument, 0, 'p'},
+		{"no-sparse", no_argument, 0, 's'},
+		{"piece-length", required_argument, 0, 'l'},
+		{"shard", required_argument, 0, 'S'},
+		{"shard-index", required_argument, 0, 'I'},
+		{"merge", no_argument, 0, 'm'},
 		{0, 0, 0, 0}
 	};
+	string journal_path, shard_index_path;
+	bool merge = false;
 	int c, option_index;
 	while ((c = getopt_long(argc, argv, "vquf", long_options, &option_index)) != -1) {
 		
@@ -161,6 +347,48 @@ int main(int argc, char *argv[]) {
 			case 'f':
 				overwrite = OVERWRITE_ALL;
 				break;
+			case 'r':
+				resume = true;
+				break;
+			case 'j':
+				journal_path = optarg;
+				break;
+			case 'p':
+				{
+					char *end;
+					errno = 0;
+					long n = strtol(optarg, &end, 10);
+					if (errno || end == optarg || *end || n < 1 || n > max_per_device) {
+						cerr << "--per-device needs to be a number from 1 to " << max_per_device << endl;
+						usage();
+						return 1;
+					}
+					per_device = n;
+				}
+				break;
+			case 's':
+				skip_holes = false;
+				break;
+			case 'l':
+				if (!piece_policy.parse(optarg)) {
+					cerr << "Can't make sense of --piece-length " << optarg << endl;
+					usage();
+					return 1;
+				}
+				break;
+			case 'S':
+				if (!plan.parse(optarg)) {
+					cerr << "--shard wants i/N, with 0 <= i < N" << endl;
+					usage();
+					return 1;
+				}
+				break;
+			case 'I':
+				shard_index_path = optarg;
+				break;
+			case 'm':
+				merge = true;
+				break;
 			case 0:
 				{
 					filesystem::path t = filesystem::absolute(optarg);
@@ -182,6 +410,19 @@ int main(int argc, char *argv[]) {
 		}
 	}
 	
+	if (merge) {
+		if (argc < optind + 1) {
+			usage();
+			return 1;
+		}
+		filesystem::create_directories(argv[optind]);
+		vector<filesystem::path> shard_dirs;
+		for (int i = optind; i < argc; i++) {
+			shard_dirs.push_back(argv[i]);
+		}
+		return shard::merge(argv[optind], shard_dirs) ? 0 : 6;
+	}
+	
 	if (argc != optind + 3) {
 		usage();
 		return 1;
@@ -213,34 +454,81 @@ int main(int argc, char *argv[]) {
 		}
 	}
 	
+	// shards may share a save directory, so each keeps its own journal/index.
+	string meta_suffix = plan.active() ? shard::suffix(plan.getIndex(), plan.getCount()) : "";
+	if (!shard_index_path.empty()) {
+		plan.balance(shard_index_path);
+	}
+	if (journal_path.empty()) {
+		journal_path = out_path / (".torrent_tree.journal" + meta_suffix);
+	}
+	if (resume) {
+		run_journal.load(journal_path);
+	}
+	if (!run_journal.open(journal_path, resume)) {
+		return 4;
+	}
+	run_journal.setDataDir(out_path);
+	string index_path = out_path / (".torrent_tree.index" + meta_suffix);
+	if (plan.active() && !filesystem::exists(index_path)) {
+		// first sharded run after an unsharded (or merged) one.
+		run_index.load(out_path / ".torrent_tree.index");
+	} else {
+		run_index.load(index_path);
+	}
+	
 	// because we did no error checking above, getting here should mean all is well
 	// (or exceptions would've occurred).  That's right, I just bragged about not checking for errors.
 	if (start_path.back() == '/') start_path.pop_back();
-	vector<filesystem::path> path_stack {start_path};
-	torrent_file_name = path_stack.back().has_filename() ? path_stack.back().filename()
-		: (path_stack.back().has_parent_path() ? path_stack.back().parent_path().filename() : ".");
+	filesystem::path root(start_path);
+	torrent_file_name = root.has_filename() ? root.filename()
+		: (root.has_parent_path() ? root.parent_path().filename() : ".");
 	// there's a couple different ways for just dot as a name.
 	if (torrent_file_name == ".") torrent_file_name = "files";
 	
-	for (size_t i = 0; i < path_stack.size(); i++) {
-		for (auto &entry : filesystem::directory_iterator(path_stack[i])) {
-			if (entry.is_regular_file()) {
-				
-				process_file(entry);
-				
-			} else if (entry.is_directory()) {
-				filesystem::path t = filesystem::absolute(entry.path());
-				if (ignored_dirs.count(t)) {
-					if (verbose) {
-						cout << "Skipping ignored directory " << t << endl;
-					}
-					continue;
+	io_sched::DeviceScheduler sched;
+	shard::Manifest manifest;
+	manifest.index = plan.getIndex();
+	manifest.count = plan.getCount();
+	torrent_sync::walk_tree(start_path, ignored_dirs,
+		[&](const filesystem::directory_entry &entry) {
+			if (plan.active()) {
+				string rel_path = relative_path(entry.path());
+				manifest.see(rel_path);
+				if (!plan.mine(rel_path)) {
+					return;
 				}
-				path_stack.push_back(entry.path());
+				manifest.files.insert(rel_path);
+			}
+			if (!sched.add(entry)) {
+				perror("failed to stat file");
+			}
+		},
+		[](const filesystem::path &t) {
+			if (verbose) {
+				cout << "Skipping ignored directory " << t << endl;
 			}
+		});
+	
+	if (plan.active()) {
+		if (verbose) {
+			cout << "Shard " << plan.getIndex() << " of " << plan.getCount() << ": " << manifest.files.size()
+				<< " of " << manifest.tree_files << " files" << endl;
+		}
+		if (!manifest.save(out_path / (".torrent_tree.manifest" + meta_suffix))) {
+			return 5;
 		}
 	}
 	
+	if (verbose) {
+		cout << "Reading from " << sched.deviceCount() << " device(s), " << per_device << " file(s) at a time each" << endl;
+		cout << "Piece lengths: " << piece_policy.describe() << endl;
+	}
+	sched.run(per_device, process_file);
+	run_journal.close();
 	
+	if (!run_index.save(index_path)) {
+		return 5;
+	}
 	return 0;
 }
\ No newline at end of file